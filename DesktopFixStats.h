@@ -0,0 +1,66 @@
+#ifndef __DesktopFixStats__
+#define __DesktopFixStats__
+
+#include <Types.h>
+
+// Performance counters published by the DesktopFix INIT.
+//
+// Gestalt(kDesktopFixGestalt, &response) returns a pointer to a
+// DesktopFixStats that lives in the system heap and is updated live by
+// the patches. Check version before reading anything else; fields are
+// only ever added at the end, so a newer INIT stays readable by an
+// older monitor as long as structSize covers what it reads.
+
+#define kDesktopFixGestalt          'DsFx'
+#define kDesktopFixStatsVersion     3
+
+// Indices into DesktopFixStats.traps
+enum {
+    kDFTrapFillCRgn = 0,
+    kDFTrapEraseRect,
+    kDFTrapEraseRgn,
+    kDFTrapCount
+};
+
+// Indices into DesktopFixStats.rejects[trap]: the guard that turned a
+// call away, in the order the guards run. Every call counted in calls
+// is either fixed or rejected once; nested calls are not in calls.
+enum {
+    kDFRejectSize = 0,      // empty, or over the size cap
+    kDFRejectPort,          // not WMgrCPort, or no bkPixPat to erase with
+    kDFRejectNested,        // inside another patched call on this thread
+    kDFRejectScreens,       // no screen at a depth we render
+    kDFRejectOffscreen,     // port doesn't draw to a screen
+    kDFRejectMenuBar,       // reaches into the menu bar
+    kDFRejectWindows,       // entirely under the windows
+    kDFRejectCount
+};
+
+typedef struct {
+    unsigned long   calls;          // top-level calls to the patch
+    unsigned long   fixed;          // calls that passed the guards
+    unsigned long   pixels;         // framebuffer pixels written by us
+    UnsignedWide    renderMicros;   // time in RenderPatternInRgn/InRect
+    UnsignedWide    trapMicros;     // time in the original trap, fixed calls only
+} DFTrapStats;
+
+typedef struct {
+    short           version;        // kDesktopFixStatsVersion
+    short           structSize;     // sizeof(DesktopFixStats)
+    DFTrapStats     traps[kDFTrapCount];
+
+    // Cache arena: every cache lives in one system heap block
+    unsigned long   cacheBudget;    // bytes currently reserved for caches
+    unsigned long   cacheResident;  // bytes of that holding cache data
+    unsigned long   cachePurges;    // cache blocks dropped to make room
+    unsigned long   cacheTrimmed;   // bytes handed back to the system heap
+
+    // Version 2: calls turned away, by trap and guard
+    unsigned long   rejects[kDFTrapCount][kDFRejectCount];
+
+    // Version 3: what PatchedEraseRect adds to an erase the size check
+    // turns away, over the original trap; timed once at startup
+    unsigned long   eraseRejectNanos;
+} DesktopFixStats;
+
+#endif /* __DesktopFixStats__ */
@@ -0,0 +1,51 @@
+#ifndef __DesktopFixTrace__
+#define __DesktopFixTrace__
+
+#include <Types.h>
+
+// Trace of recent patched calls kept by the DesktopFix INIT (kOptTrace).
+//
+// Gestalt(kDesktopFixTraceGestalt, &response) returns a pointer to a
+// DesktopFixTrace in the system heap. Entries are written in a ring:
+// the call numbered n lands in entries[n % entryCount], and next is
+// the number of calls recorded so far, so the oldest entry still held
+// is next - entryCount (or 0).
+//
+// DumpTrace writes the block to a file as it is in memory (68k byte
+// order, two-byte alignment); DesktopFixBench -r replays such a file.
+// The offsets of every field are fixed, so the host side can read it
+// without the Mac headers.
+
+#define kDesktopFixTraceGestalt     'DsFt'
+#define kDesktopFixTraceVersion     1
+
+#define kDFTraceEntries             128
+#define kDFTraceRgnBytes            512     // largest region copied whole
+
+// DFTraceEntry.flags
+enum {
+    kDFTraceQualified   = 0x0001,   // passed the guards (counted as fixed)
+    kDFTraceRgnTooBig   = 0x0002    // region over kDFTraceRgnBytes, not copied
+};
+
+typedef struct {
+    short           trap;           // kDFTrap* index from DesktopFixStats.h
+    short           flags;          // kDFTrace* bits
+    Rect            bounds;         // the rect, or the region's rgnBBox
+    long            port;           // current GrafPtr at the call
+    unsigned long   micros;         // time spent in the patch
+    unsigned short  rgnSize;        // rgnSize of the region, 0 for rects
+    short           rgnBytes;       // bytes of it in rgnData
+    unsigned char   rgnData[kDFTraceRgnBytes];  // the region, header and all
+} DFTraceEntry;
+
+typedef struct {
+    short           version;        // kDesktopFixTraceVersion
+    short           entrySize;      // sizeof(DFTraceEntry)
+    long            structSize;     // sizeof(DesktopFixTrace)
+    long            entryCount;     // kDFTraceEntries
+    unsigned long   next;           // calls recorded so far
+    DFTraceEntry    entries[kDFTraceEntries];
+} DesktopFixTrace;
+
+#endif /* __DesktopFixTrace__ */
@@ -0,0 +1,196 @@
+/*
+ * DesktopFix cache arena - see arena.h
+ *
+ * The arena is a run of blocks, each starting with an ArenaBlock
+ * header and laid end to end, so walking it is just adding sizes. Only
+ * a handful of caches ever hold blocks, which keeps first fit, the
+ * largest-first purge and coalescing on free cheap enough as plain
+ * linear walks.
+ */
+
+#include <Memory.h>
+#include "arena.h"
+
+typedef struct {
+    long size;              /* bytes, header included; multiple of 16 */
+    ArenaPurgeProc purge;   /* owner's purge proc, NULL when free */
+    unsigned long epoch;    /* last call that used the block */
+} ArenaBlock;
+
+/* Headers are padded so the data after them stays 16-byte aligned */
+#define kHeaderSize     ((long)((sizeof(ArenaBlock) + 15) & ~15UL))
+#define kMinBlock       (kHeaderSize + 16)
+
+#define FirstBlock()    ((ArenaBlock *)gArenaBase)
+#define NextBlock(b)    ((ArenaBlock *)((Ptr)(b) + (b)->size))
+#define IsInArena(b)    ((Ptr)(b) < gArenaBase + gArenaSize)
+
+static Ptr gArenaBlock = NULL;      /* as returned by NewPtrSys */
+static Ptr gArenaBase = NULL;       /* first block, 16-byte aligned */
+static unsigned long gEpoch = 1;
+
+long gArenaSize = 0;
+long gArenaUsed = 0;
+unsigned long gArenaPurges = 0;
+
+Boolean ArenaInit(long size)
+{
+    long tries;
+    ArenaBlock *b;
+
+    size = (size + 15) & ~15L;
+    for (tries = 0; tries < 3 && size >= kMinBlock; tries++, size = (size / 2) & ~15L) {
+        gArenaBlock = NewPtrSys(size + 15);
+        if (gArenaBlock)
+            break;
+    }
+    if (!gArenaBlock)
+        return false;
+
+    gArenaBase = (Ptr)(((unsigned long)gArenaBlock + 15) & ~15UL);
+    gArenaSize = size;
+    b = FirstBlock();
+    b->size = size;
+    b->purge = NULL;
+    b->epoch = 0;
+    return true;
+}
+
+/* Merge every run of adjacent free blocks */
+static void Coalesce(void)
+{
+    ArenaBlock *b, *next;
+
+    for (b = FirstBlock(); IsInArena(b); b = NextBlock(b)) {
+        if (b->purge)
+            continue;
+        for (next = NextBlock(b); IsInArena(next) && !next->purge; next = NextBlock(b))
+            b->size += next->size;
+    }
+}
+
+/*
+ * Drop the largest live block, sparing the ones in use by the current
+ * call if spareCurrent is set. Returns false if there was none.
+ */
+static Boolean PurgeLargest(Boolean spareCurrent)
+{
+    ArenaBlock *b, *victim = NULL;
+    Ptr data;
+    long used;
+
+    for (b = FirstBlock(); IsInArena(b); b = NextBlock(b)) {
+        if (!b->purge || (spareCurrent && b->epoch == gEpoch))
+            continue;
+        if (!victim || b->size > victim->size)
+            victim = b;
+    }
+    if (!victim)
+        return false;
+
+    /* The header may be merged away by the owner's ArenaFree */
+    data = (Ptr)victim + kHeaderSize;
+    used = gArenaUsed;
+    victim->purge(data);
+    if (gArenaUsed == used)
+        ArenaFree(data);
+    gArenaPurges++;
+    return true;
+}
+
+Ptr ArenaAlloc(long size, ArenaPurgeProc purge)
+{
+    ArenaBlock *b, *rest;
+    long need;
+
+    if (!gArenaBase || size <= 0 || !purge)
+        return NULL;
+
+    need = kHeaderSize + ((size + 15) & ~15L);
+    for (;;) {
+        for (b = FirstBlock(); IsInArena(b); b = NextBlock(b))
+            if (!b->purge && b->size >= need)
+                break;
+        if (IsInArena(b))
+            break;
+        if (!PurgeLargest(true))
+            return NULL;
+    }
+
+    if (b->size - need >= kMinBlock) {
+        rest = (ArenaBlock *)((Ptr)b + need);
+        rest->size = b->size - need;
+        rest->purge = NULL;
+        rest->epoch = 0;
+        b->size = need;
+    }
+    b->purge = purge;
+    b->epoch = gEpoch;
+    gArenaUsed += b->size;
+    return (Ptr)b + kHeaderSize;
+}
+
+void ArenaFree(Ptr block)
+{
+    ArenaBlock *b;
+
+    if (!block)
+        return;
+
+    b = (ArenaBlock *)(block - kHeaderSize);
+    gArenaUsed -= b->size;
+    b->purge = NULL;
+    Coalesce();
+}
+
+void ArenaNewEpoch(void)
+{
+    gEpoch++;
+}
+
+void ArenaTouch(Ptr block)
+{
+    if (block)
+        ((ArenaBlock *)(block - kHeaderSize))->epoch = gEpoch;
+}
+
+long ArenaTrim(long needed)
+{
+    ArenaBlock *b, *last;
+    long release;
+
+    if (!gArenaBase)
+        return 0;
+
+    /* More than the arena holds: give back all of it that we can */
+    needed = (needed + 15) & ~15L;
+    if (needed > gArenaSize - kMinBlock)
+        needed = gArenaSize - kMinBlock;
+    if (needed <= 0)
+        return 0;
+
+    for (;;) {
+        for (last = b = FirstBlock(); IsInArena(b); b = NextBlock(b))
+            last = b;
+        if (!last->purge && last->size >= needed)
+            break;
+        if (!PurgeLargest(false))
+            return 0;
+    }
+
+    /* Give back the free tail, keeping one empty block if that's all */
+    release = last->size;
+    if (last == FirstBlock())
+        release -= kMinBlock;
+    if (release <= 0)
+        return 0;
+
+    SetPtrSize(gArenaBlock, (gArenaBase - gArenaBlock) + gArenaSize - release);
+    if (MemError() != noErr)
+        return 0;
+
+    gArenaSize -= release;
+    if (last == FirstBlock())
+        last->size -= release;
+    return release;
+}
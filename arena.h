@@ -0,0 +1,55 @@
+/*
+ * DesktopFix cache arena
+ *
+ * One system heap block, reserved at INIT time, that every cache the
+ * renderer keeps (expanded tiles, staging buffer, decoded regions,
+ * the backing store strip) is carved from. Nothing calls NewPtr on the
+ * trap path, and the caches together can never grow past the budget
+ * the arena was reserved with.
+ *
+ * Every block has a purge proc. When an allocation doesn't fit, the
+ * arena drops other blocks, largest first, until it does; blocks
+ * allocated or touched since the last ArenaNewEpoch are in use by the
+ * current call and are never dropped that way. A purge proc must call
+ * ArenaFree on its block and forget it.
+ */
+
+#ifndef __arena__
+#define __arena__
+
+#include <Memory.h>
+
+typedef void (*ArenaPurgeProc)(Ptr block);
+
+/* Arena size, bytes of it in live blocks, blocks dropped for room */
+extern long gArenaSize;
+extern long gArenaUsed;
+extern unsigned long gArenaPurges;
+
+/*
+ * Reserve the arena. Retries at half the size, down to a quarter,
+ * if the system heap can't spare all of it. Returns false if nothing
+ * could be reserved; every ArenaAlloc then fails.
+ */
+Boolean ArenaInit(long size);
+
+/* 16-byte aligned block of size bytes, or NULL */
+Ptr ArenaAlloc(long size, ArenaPurgeProc purge);
+void ArenaFree(Ptr block);
+
+/* Start a new top-level call; blocks from earlier ones become purgeable */
+void ArenaNewEpoch(void);
+
+/* Mark a block as in use by the current call */
+void ArenaTouch(Ptr block);
+
+/*
+ * Memory pressure from outside: drop blocks, largest first and in use
+ * or not, until at least needed bytes at the end of the arena are
+ * free, then hand them back to the system heap. Returns the number of
+ * bytes released. Asking for more than the arena holds empties it.
+ * The caller must make sure no cache is in use.
+ */
+long ArenaTrim(long needed);
+
+#endif /* __arena__ */
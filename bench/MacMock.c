@@ -0,0 +1,87 @@
+/*
+ * Host implementations of the mock Toolbox calls in MacMock.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "MacMock.h"
+
+char HGetState(Handle h)
+{
+    (void)h;
+    return 0;
+}
+
+void HLock(Handle h)
+{
+    (void)h;
+}
+
+void HUnlock(Handle h)
+{
+    (void)h;
+}
+
+void HSetState(Handle h, char state)
+{
+    (void)h;
+    (void)state;
+}
+
+Ptr NewPtrSys(Size size)
+{
+    return (Ptr)malloc(size);
+}
+
+void DisposePtr(Ptr p)
+{
+    free(p);
+}
+
+/* Shrinking in place always works; the freed tail just isn't reused */
+void SetPtrSize(Ptr p, Size newSize)
+{
+    (void)p;
+    (void)newSize;
+}
+
+OSErr MemError(void)
+{
+    return noErr;
+}
+
+void BlockMoveData(const void *src, void *dst, Size count)
+{
+    memmove(dst, src, count);
+}
+
+/*
+ * PtInRgn by definition: a point is inside when an odd number of
+ * inversion points lie at or above-left of it.
+ */
+Boolean PtInRgn(Point pt, RgnHandle rgn)
+{
+    RgnPtr r = *rgn;
+    const short *p, *end;
+    short v;
+    int inside = 0;
+
+    if (pt.h < r->rgnBBox.left || pt.h >= r->rgnBBox.right ||
+        pt.v < r->rgnBBox.top || pt.v >= r->rgnBBox.bottom)
+        return false;
+    if (r->rgnSize <= 10)
+        return true;
+
+    p = (const short *)((char *)r + 10);
+    end = (const short *)((char *)r + r->rgnSize);
+    while (p < end && *p != 0x7FFF) {
+        v = *p++;
+        while (p < end && *p != 0x7FFF) {
+            if (v <= pt.v && *p <= pt.h)
+                inside ^= 1;
+            p++;
+        }
+        p++;
+    }
+    return inside;
+}
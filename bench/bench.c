@@ -0,0 +1,467 @@
+/*
+ * DesktopFix host benchmark
+ *
+ * Runs the pattern rendering core (render.c) over a fixed set of tiles,
+ * region shapes and framebuffer pitches, and reports pixels/second for
+ * each combination. Everything is generated from a fixed seed, so runs
+ * are repeatable and can be compared before and after a change.
+ *
+ * Usage: DesktopFixBench [-t ms] [-f filter] [-s seed] [-m mode]
+ *   -t ms      minimum time spent on each case (default 100)
+ *   -f filter  only run cases whose name contains filter
+ *   -s seed    PRNG seed for tiles and shapes (default 1)
+ *   -m mode    screen blit mode, direct or staged (default direct)
+ *   -b kbytes  backing store budget (default 0, off)
+ *   -d depth   screen depth, 32 or 16 (default 32); pitches scale with it
+ *   -c entries decoded region cache size, 0 to 4 (default 4)
+ *   -a kbytes  cache arena, on top of the backing store (default 256)
+ *   -r file    also replay a trace saved by DumpTrace, as the "replay"
+ *              shape: the qualifying calls in the order they were made
+ *   -v cases   instead of benchmarking, check every render path against
+ *              a per-pixel reference on that many random cases (see
+ *              verify.h); exits 1 on any mismatch or slowdown
+ *   -B file    with -v, also fail on paths 20% slower than in file
+ *   -w file    with -v, save each path's rate to file for -B
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fixtures.h"
+#include "render.h"
+#include "arena.h"
+#include "DesktopFixStats.h"
+#include "DesktopFixTrace.h"
+#include "verify.h"
+
+#define kScreenW    1152
+#define kScreenH    870
+#define kCopies     16      /* positions each small shape is drawn at */
+
+enum { kTilePix, kTileUniform, kTileOld, kTileRGB };
+
+typedef struct {
+    const char *name;
+    short kind;
+    short width;
+    short height;
+    short depth;
+} TileSpec;
+
+/*
+ * The 8bpp watermark first, then the other sizes desktop patterns come
+ * in, then other tile depths, then solid desktops: a one-color tile, an
+ * old 8x8 pattern and an RGB pattern
+ */
+static const TileSpec kTiles[] = {
+    { "wmark128", kTilePix, 128, 128, 8 },
+    { "tile8", kTilePix, 8, 8, 8 },
+    { "tile16", kTilePix, 16, 16, 8 },
+    { "tile64", kTilePix, 64, 64, 8 },
+    { "odd37x23", kTilePix, 37, 23, 8 },
+    { "d1_64", kTilePix, 64, 64, 1 },
+    { "d4_64", kTilePix, 64, 64, 4 },
+    { "d16_64", kTilePix, 64, 64, 16 },
+    { "d32_64", kTilePix, 64, 64, 32 },
+    { "uniform64", kTileUniform, 64, 64, 8 },
+    { "old8", kTileOld, 8, 8, 1 },
+    { "rgb", kTileRGB, 8, 8, 8 },
+};
+
+static PixPatHandle NewTile(const TileSpec *spec)
+{
+    switch (spec->kind) {
+    case kTileUniform:
+        return FixNewUniformPixPat(spec->width, spec->height);
+    case kTileOld:
+        return FixNewOldPixPat();
+    case kTileRGB:
+        return FixNewRGBPixPat();
+    }
+    return FixNewPixPatDepth(spec->width, spec->height, spec->depth);
+}
+
+typedef struct {
+    const char *name;
+    long rowBytes;
+} PitchSpec;
+
+static const PitchSpec kPitches[] = {
+    { "tight", kScreenW * 4L },
+    { "pad64", kScreenW * 4L + 64 },
+    { "pow2", 2048 * 4L },
+};
+
+/* Region shapes; NULL rgns[] means the case goes through RenderPatternInRect */
+enum { kShapeLabel, kShapeHover, kShapeRect, kShapeNoise, kShapeDesktop, kShapeErase, kShapeCount,
+       kShapeReplay = kShapeCount };
+
+static const char *kShapeNames[kShapeCount + 1] = {
+    "label", "hover", "rect250", "noise64", "desktop", "erase", "replay"
+};
+
+#define kHoverCopies 4      /* icons a highlight storm keeps redrawing */
+
+/* Big enough for a whole trace; the synthetic shapes use kCopies */
+typedef struct {
+    RgnHandle rgns[kDFTraceEntries];
+    Rect rects[kDFTraceEntries];
+    short count;
+} ShapeSet;
+
+/* Position of copy i of a w x h shape, spread over the screen */
+static void CopyOrigin(short i, short w, short h, short *left, short *top)
+{
+    *left = (short)(FixRandom() % (kScreenW - w));
+    *top = (short)(20 + FixRandom() % (kScreenH - 20 - h));
+    (void)i;
+}
+
+/* Icon mask (a 32px disc) over a 70x12 name label, as the Finder draws */
+static unsigned char *LabelMask(short *w, short *h)
+{
+    unsigned char *m;
+    short x, y, dx, dy;
+
+    *w = 70;
+    *h = 46;
+    m = (unsigned char *)calloc(1, *w * *h);
+    for (y = 0; y < 32; y++) {
+        for (x = 0; x < 32; x++) {
+            dx = x * 2 - 31;
+            dy = y * 2 - 31;
+            if (dx * dx + dy * dy <= 32 * 32)
+                m[y * *w + 19 + x] = 1;
+        }
+    }
+    for (y = 34; y < 46; y++)
+        for (x = 0; x < 70; x++)
+            m[y * *w + x] = 1;
+    return m;
+}
+
+static unsigned char *NoiseMask(short w, short h)
+{
+    unsigned char *m = (unsigned char *)malloc((long)w * h);
+    long i;
+
+    for (i = 0; i < (long)w * h; i++)
+        m[i] = FixRandom() & 1;
+    return m;
+}
+
+/* Full screen below the menu bar, minus a dozen overlapping windows */
+static unsigned char *DesktopMask(void)
+{
+    unsigned char *m = (unsigned char *)malloc((long)kScreenW * kScreenH);
+    short i, x, y, l, t, r, b;
+
+    memset(m, 1, (long)kScreenW * kScreenH);
+    memset(m, 0, 20L * kScreenW);
+    for (i = 0; i < 12; i++) {
+        l = (short)(FixRandom() % (kScreenW - 200));
+        t = (short)(20 + FixRandom() % (kScreenH - 200));
+        r = l + 120 + (short)(FixRandom() % 400);
+        b = t + 80 + (short)(FixRandom() % 300);
+        if (r > kScreenW) r = kScreenW;
+        if (b > kScreenH) b = kScreenH;
+        for (y = t; y < b; y++)
+            for (x = l; x < r; x++)
+                m[(long)y * kScreenW + x] = 0;
+    }
+    return m;
+}
+
+static void BuildShape(short shape, ShapeSet *set)
+{
+    unsigned char *m;
+    short i, w, h, left, top;
+
+    memset(set, 0, sizeof(*set));
+    switch (shape) {
+    case kShapeLabel:
+        m = LabelMask(&w, &h);
+        for (i = 0; i < kCopies; i++) {
+            CopyOrigin(i, w, h, &left, &top);
+            set->rgns[i] = FixRgnFromMask(m, w, h, left, top);
+        }
+        free(m);
+        set->count = kCopies;
+        break;
+    case kShapeHover:
+        m = LabelMask(&w, &h);
+        for (i = 0; i < kHoverCopies; i++) {
+            CopyOrigin(i, w, h, &left, &top);
+            set->rgns[i] = FixRgnFromMask(m, w, h, left, top);
+        }
+        free(m);
+        set->count = kHoverCopies;
+        break;
+    case kShapeRect:
+        for (i = 0; i < kCopies; i++) {
+            CopyOrigin(i, 250, 250, &left, &top);
+            set->rgns[i] = FixRectRgn(left, top, left + 250, top + 250);
+        }
+        set->count = kCopies;
+        break;
+    case kShapeNoise:
+        for (i = 0; i < kCopies; i++) {
+            m = NoiseMask(64, 64);
+            CopyOrigin(i, 64, 64, &left, &top);
+            set->rgns[i] = FixRgnFromMask(m, 64, 64, left, top);
+            free(m);
+        }
+        set->count = kCopies;
+        break;
+    case kShapeDesktop:
+        m = DesktopMask();
+        set->rgns[0] = FixRgnFromMask(m, kScreenW, kScreenH, 0, 0);
+        free(m);
+        set->count = 1;
+        break;
+    case kShapeErase:
+        for (i = 0; i < kCopies; i++) {
+            CopyOrigin(i, 300, 20, &left, &top);
+            set->rects[i].left = left;
+            set->rects[i].top = top;
+            set->rects[i].right = left + 300;
+            set->rects[i].bottom = top + 20;
+        }
+        set->count = kCopies;
+        break;
+    }
+}
+
+static void FreeShape(ShapeSet *set)
+{
+    short i;
+
+    for (i = 0; i < set->count; i++)
+        if (set->rgns[i])
+            FixDisposeRgn(set->rgns[i]);
+}
+
+/*
+ * Trace file layout (see DesktopFixTrace.h): 68k byte order, fixed
+ * offsets, so it is read field by field rather than through the struct.
+ */
+#define kTraceHeaderSize    16
+#define kTraceEntrySize     (24 + kDFTraceRgnBytes)
+
+static short GetBE16(const unsigned char *p)
+{
+    return (short)((p[0] << 8) | p[1]);
+}
+
+static unsigned long GetBE32(const unsigned char *p)
+{
+    return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) |
+           ((unsigned long)p[2] << 8) | p[3];
+}
+
+/*
+ * Load the qualifying calls of a trace, oldest first, into set. Rects
+ * are EraseRect calls; regions too big to have been copied are
+ * skipped. Returns false if the file can't be read or isn't a trace.
+ */
+static int LoadTrace(const char *path, ShapeSet *set)
+{
+    FILE *f = fopen(path, "rb");
+    unsigned char *buf;
+    const unsigned char *e;
+    unsigned long next, k, first, count, skipped = 0;
+    long size, entries;
+    short flags, rgnSize, rgnBytes;
+
+    memset(set, 0, sizeof(*set));
+    if (!f)
+        return 0;
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    buf = (unsigned char *)malloc(size > 0 ? size : 1);
+    if (size < kTraceHeaderSize || fread(buf, 1, size, f) != (size_t)size) {
+        fclose(f);
+        free(buf);
+        return 0;
+    }
+    fclose(f);
+
+    entries = (long)GetBE32(buf + 8);
+    if (GetBE16(buf) != kDesktopFixTraceVersion ||
+        GetBE16(buf + 2) != kTraceEntrySize ||
+        entries < 1 || entries > kDFTraceEntries ||
+        size < kTraceHeaderSize + entries * kTraceEntrySize) {
+        free(buf);
+        return 0;
+    }
+
+    next = GetBE32(buf + 12);
+    count = next < (unsigned long)entries ? next : (unsigned long)entries;
+    first = next - count;
+    for (k = first; k < next; k++) {
+        e = buf + kTraceHeaderSize + (k % entries) * kTraceEntrySize;
+        flags = GetBE16(e + 2);
+        if (!(flags & kDFTraceQualified))
+            continue;
+
+        if (GetBE16(e) == kDFTrapEraseRect) {
+            set->rects[set->count].top = GetBE16(e + 4);
+            set->rects[set->count].left = GetBE16(e + 6);
+            set->rects[set->count].bottom = GetBE16(e + 8);
+            set->rects[set->count].right = GetBE16(e + 10);
+            set->count++;
+            continue;
+        }
+
+        rgnSize = GetBE16(e + 20);
+        rgnBytes = GetBE16(e + 22);
+        if ((flags & kDFTraceRgnTooBig) || rgnSize < 10 ||
+            rgnBytes != rgnSize || rgnBytes > kDFTraceRgnBytes) {
+            skipped++;
+            continue;
+        }
+        set->rgns[set->count++] = FixRgnFromBytes(e + 24, rgnBytes);
+    }
+    free(buf);
+
+    printf("trace %s: %lu calls recorded, %d qualifying replayed, %lu too big to replay\n",
+           path, next, set->count, skipped);
+    return 1;
+}
+
+/* Render the shape set repeatedly for at least minTime; returns pixels/s */
+static double RunCase(const ShapeSet *set, PixPatHandle pp, double minTime,
+                      unsigned long *pixelsOut)
+{
+    double start, elapsed;
+    unsigned long pixels;
+    short i;
+
+    /* Warm the tile cache so the first expansion isn't timed */
+    if (set->rgns[0])
+        RenderPatternInRgn(set->rgns[0], pp);
+    else
+        RenderPatternInRect(&set->rects[0], pp);
+
+    pixels = gPixelsWritten;
+    start = FixNow();
+    do {
+        for (i = 0; i < set->count; i++) {
+            if (set->rgns[i])
+                RenderPatternInRgn(set->rgns[i], pp);
+            else
+                RenderPatternInRect(&set->rects[i], pp);
+        }
+        elapsed = FixNow() - start;
+    } while (elapsed < minTime);
+
+    *pixelsOut = gPixelsWritten - pixels;
+    return *pixelsOut / elapsed;
+}
+
+int main(int argc, char **argv)
+{
+    double minTime = 0.1;
+    const char *filter = NULL;
+    unsigned long seed = 1, pixels;
+    short blitMode = kBlitDirect;
+    short depth = 32;
+    char name[64];
+    short t, s, p;
+    int i;
+    PixPatHandle pp;
+    ShapeSet set, trace;
+    const char *tracePath = NULL;
+    const char *baseline = NULL, *save = NULL;
+    long verifyCases = 0;
+    long cacheBudget = 256L * 1024;
+    double rate;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-t") && i + 1 < argc)
+            minTime = atof(argv[++i]) / 1000.0;
+        else if (!strcmp(argv[i], "-f") && i + 1 < argc)
+            filter = argv[++i];
+        else if (!strcmp(argv[i], "-s") && i + 1 < argc)
+            seed = strtoul(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "-m") && i + 1 < argc &&
+                 (!strcmp(argv[i + 1], "direct") || !strcmp(argv[i + 1], "staged")))
+            blitMode = !strcmp(argv[++i], "staged") ? kBlitStaged : kBlitDirect;
+        else if (!strcmp(argv[i], "-b") && i + 1 < argc)
+            gBackingBudget = strtol(argv[++i], NULL, 0) * 1024;
+        else if (!strcmp(argv[i], "-d") && i + 1 < argc &&
+                 (!strcmp(argv[i + 1], "32") || !strcmp(argv[i + 1], "16")))
+            depth = (short)atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-c") && i + 1 < argc)
+            gSpanCacheSize = (short)atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-a") && i + 1 < argc)
+            cacheBudget = strtol(argv[++i], NULL, 0) * 1024;
+        else if (!strcmp(argv[i], "-r") && i + 1 < argc)
+            tracePath = argv[++i];
+        else if (!strcmp(argv[i], "-v") && i + 1 < argc)
+            verifyCases = strtol(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "-B") && i + 1 < argc)
+            baseline = argv[++i];
+        else if (!strcmp(argv[i], "-w") && i + 1 < argc)
+            save = argv[++i];
+        else {
+            fprintf(stderr, "usage: %s [-t ms] [-f filter] [-s seed] [-m direct|staged] [-b kbytes] [-d 32|16] [-c entries] [-a kbytes] [-r trace] [-v cases [-B file] [-w file]]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+
+    /* The verifier sets up its own modes and arena */
+    if (verifyCases > 0)
+        return RunVerify(seed, verifyCases, cacheBudget, baseline, save);
+
+    gRender16 = depth == 16;
+    if (!ArenaInit(cacheBudget + gBackingBudget)) {
+        fprintf(stderr, "%s: can't reserve the cache arena\n", argv[0]);
+        return 2;
+    }
+    trace.count = 0;
+    if (tracePath && !LoadTrace(tracePath, &trace)) {
+        fprintf(stderr, "%s: can't read trace %s\n", argv[0], tracePath);
+        return 2;
+    }
+    printf("%-32s %12s %12s\n", "case", "pixels", "Mpix/s");
+
+    for (p = 0; p < (short)(sizeof(kPitches) / sizeof(kPitches[0])); p++) {
+        FixSetScreenDepth(0, kScreenW, kScreenH,
+                          kPitches[p].rowBytes * depth / 32, depth);
+        gScreens[0].blitMode = blitMode;
+
+        for (t = 0; t < (short)(sizeof(kTiles) / sizeof(kTiles[0])); t++) {
+            FixSeed(seed + t);
+            pp = NewTile(&kTiles[t]);
+
+            for (s = 0; s <= kShapeCount; s++) {
+                if (s == kShapeReplay && !trace.count)
+                    continue;
+                snprintf(name, sizeof(name), "%s/%s/%s",
+                         kTiles[t].name, kShapeNames[s], kPitches[p].name);
+                if (filter && !strstr(name, filter))
+                    continue;
+
+                if (s == kShapeReplay) {
+                    rate = RunCase(&trace, pp, minTime, &pixels);
+                } else {
+                    FixSeed(seed * 7919 + s);
+                    BuildShape(s, &set);
+                    rate = RunCase(&set, pp, minTime, &pixels);
+                    FreeShape(&set);
+                }
+                printf("%-32s %12lu %12.1f\n", name, pixels, rate / 1e6);
+                fflush(stdout);
+            }
+
+            FixDisposePixPat(pp);
+        }
+    }
+
+    FreeShape(&trace);
+    FixFreeScreens();
+    return 0;
+}
@@ -0,0 +1,279 @@
+/*
+ * Test fixtures for the host bench - see fixtures.h
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "fixtures.h"
+#include "render.h"
+
+static unsigned long gFixState = 1;
+
+void FixSeed(unsigned long seed)
+{
+    gFixState = seed ? seed : 1;
+}
+
+/* xorshift32 */
+unsigned long FixRandom(void)
+{
+    UInt32 x = (UInt32)gFixState;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    gFixState = x;
+    return x;
+}
+
+double FixNow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static Handle NewHandleFrom(void *p)
+{
+    Handle h = (Handle)malloc(sizeof(Ptr));
+
+    *h = (Ptr)p;
+    return h;
+}
+
+static void DisposeHandleTo(Handle h)
+{
+    if (h) {
+        free(*h);
+        free(h);
+    }
+}
+
+PixPatHandle FixNewPixPat(short width, short height)
+{
+    return FixNewPixPatDepth(width, height, 8);
+}
+
+PixPatHandle FixNewPixPatDepth(short width, short height, short depth)
+{
+    PixPatPtr pat;
+    PixMapPtr pm;
+    CTabPtr ct;
+    unsigned char *data;
+    short rowBytes, i;
+    long n;
+
+    rowBytes = (short)((((long)width * depth + 15) >> 4) << 1);
+    data = (unsigned char *)malloc((long)rowBytes * height);
+    for (n = 0; n < (long)rowBytes * height; n++)
+        data[n] = (unsigned char)FixRandom();
+
+    ct = (CTabPtr)calloc(1, sizeof(ColorTable) + 255 * sizeof(ColorSpec));
+    ct->ctSeed = (long)FixRandom();
+    ct->ctSize = depth < 8 ? (1 << depth) - 1 : 255;
+    for (i = 0; i < 256; i++) {
+        ct->ctTable[i].value = i;
+        ct->ctTable[i].rgb.red = (unsigned short)FixRandom();
+        ct->ctTable[i].rgb.green = (unsigned short)FixRandom();
+        ct->ctTable[i].rgb.blue = (unsigned short)FixRandom();
+    }
+
+    pm = (PixMapPtr)calloc(1, sizeof(PixMap));
+    pm->rowBytes = rowBytes | 0x8000;
+    pm->bounds.right = width;
+    pm->bounds.bottom = height;
+    pm->pixelSize = depth;
+    pm->pixelType = depth > 8 ? 16 : 0;     /* RGBDirect : indexed */
+    pm->cmpCount = depth > 8 ? 3 : 1;
+    pm->cmpSize = depth == 16 ? 5 : depth == 32 ? 8 : depth;
+    pm->pmTable = (CTabHandle)NewHandleFrom(ct);
+
+    pat = (PixPatPtr)calloc(1, sizeof(PixPat));
+    pat->patType = 1;
+    pat->patMap = (PixMapHandle)NewHandleFrom(pm);
+    pat->patData = NewHandleFrom(data);
+
+    return (PixPatHandle)NewHandleFrom(pat);
+}
+
+/* Type 1 PixPat whose 8bpp tile is all one index */
+PixPatHandle FixNewUniformPixPat(short width, short height)
+{
+    PixPatHandle pp = FixNewPixPat(width, height);
+    PixMapPtr pm = *(**pp).patMap;
+
+    memset(*(**pp).patData, FixRandom() & 0xFF,
+           (long)(pm->rowBytes & 0x3FFF) * height);
+    return pp;
+}
+
+/* Type 0 PixPat with a random 8x8 1-bit pat1Data */
+PixPatHandle FixNewOldPixPat(void)
+{
+    PixPatHandle pp = FixNewPixPat(8, 8);
+    short i;
+
+    (**pp).patType = 0;
+    for (i = 0; i < 8; i++)
+        (**pp).pat1Data.pat[i] = (UInt8)FixRandom();
+    return pp;
+}
+
+/* Type 2 PixPat; the color is the last entry of its color table */
+PixPatHandle FixNewRGBPixPat(void)
+{
+    PixPatHandle pp = FixNewPixPat(8, 8);
+
+    (**pp).patType = 2;
+    return pp;
+}
+
+void FixDisposePixPat(PixPatHandle pp)
+{
+    PixMapHandle pm = (**pp).patMap;
+
+    DisposeHandleTo((Handle)(**pm).pmTable);
+    DisposeHandleTo((Handle)pm);
+    DisposeHandleTo((**pp).patData);
+    DisposeHandleTo((Handle)pp);
+}
+
+static unsigned char MaskAt(const unsigned char *mask, short w, short h,
+                            short x, short y)
+{
+    if (x < 0 || y < 0 || x >= w || y >= h)
+        return 0;
+    return mask[(long)y * w + x] != 0;
+}
+
+RgnHandle FixRgnFromMask(const unsigned char *mask, short width, short height,
+                         short left, short top)
+{
+    short *buf, *p, *rec;
+    short x, y, minX, minY, maxX, maxY;
+    long cap;
+    Boolean any;
+    RgnPtr r;
+
+    cap = 8 + (long)(width + 2) * (height + 1) + 2 * (height + 1);
+    buf = (short *)malloc(cap * sizeof(short));
+    p = buf + 5;            /* room for rgnSize + rgnBBox */
+
+    minX = minY = 0x7FFF;
+    maxX = maxY = -1;
+
+    /* An inversion point sits wherever the 2x2 neighbourhood has odd parity */
+    for (y = 0; y <= height; y++) {
+        rec = NULL;
+        for (x = 0; x <= width; x++) {
+            any = MaskAt(mask, width, height, x, y) ^
+                  MaskAt(mask, width, height, x - 1, y) ^
+                  MaskAt(mask, width, height, x, y - 1) ^
+                  MaskAt(mask, width, height, x - 1, y - 1);
+            if (any) {
+                if (!rec) {
+                    rec = p;
+                    *p++ = top + y;
+                }
+                *p++ = left + x;
+            }
+            if (MaskAt(mask, width, height, x, y)) {
+                if (x < minX) minX = x;
+                if (x > maxX) maxX = x;
+                if (y < minY) minY = y;
+                if (y > maxY) maxY = y;
+            }
+        }
+        if (rec)
+            *p++ = 0x7FFF;
+    }
+    *p++ = 0x7FFF;
+
+    r = (RgnPtr)buf;
+    if (maxX < 0) {
+        /* Empty region */
+        r->rgnSize = 10;
+        memset(&r->rgnBBox, 0, sizeof(Rect));
+    } else {
+        r->rgnBBox.left = left + minX;
+        r->rgnBBox.top = top + minY;
+        r->rgnBBox.right = left + maxX + 1;
+        r->rgnBBox.bottom = top + maxY + 1;
+        /* A plain rectangle has exactly four inversion points: store no data */
+        r->rgnSize = (unsigned short)((p - buf) * sizeof(short));
+        if (r->rgnSize == 10 + 9 * sizeof(short)) {
+            short *d = buf + 5;
+            if (d[0] == r->rgnBBox.top && d[1] == r->rgnBBox.left &&
+                d[2] == r->rgnBBox.right && d[4] == r->rgnBBox.bottom &&
+                d[5] == r->rgnBBox.left && d[6] == r->rgnBBox.right)
+                r->rgnSize = 10;
+        }
+    }
+
+    return (RgnHandle)NewHandleFrom(buf);
+}
+
+RgnHandle FixRectRgn(short left, short top, short right, short bottom)
+{
+    RgnPtr r = (RgnPtr)malloc(sizeof(MacRegion));
+
+    r->rgnSize = 10;
+    r->rgnBBox.left = left;
+    r->rgnBBox.top = top;
+    r->rgnBBox.right = right;
+    r->rgnBBox.bottom = bottom;
+    return (RgnHandle)NewHandleFrom(r);
+}
+
+RgnHandle FixRgnFromBytes(const unsigned char *bytes, long size)
+{
+    short *buf = (short *)malloc(size);
+    long i;
+
+    for (i = 0; i < size / 2; i++)
+        buf[i] = (short)((bytes[i * 2] << 8) | bytes[i * 2 + 1]);
+    return (RgnHandle)NewHandleFrom(buf);
+}
+
+void FixDisposeRgn(RgnHandle rgn)
+{
+    DisposeHandleTo((Handle)rgn);
+}
+
+void FixSetScreen(short i, short width, short height, long rowBytes)
+{
+    FixSetScreenDepth(i, width, height, rowBytes, 32);
+}
+
+void FixSetScreenDepth(short i, short width, short height, long rowBytes,
+                       short depth)
+{
+    ScreenInfo *scr = &gScreens[i];
+
+    free(scr->baseAddr);
+    scr->baseAddr = (Ptr)calloc(1, rowBytes * height);
+    scr->rowBytes = rowBytes;
+    scr->bounds.left = 0;
+    scr->bounds.top = 0;
+    scr->bounds.right = width;
+    scr->bounds.bottom = height;
+    scr->pixelSize = depth;
+    scr->blitMode = kBlitDirect;
+    scr->spanCopy = NULL;
+    scr->device = NULL;
+    if (gScreenCount <= i)
+        gScreenCount = i + 1;
+}
+
+void FixFreeScreens(void)
+{
+    short i;
+
+    for (i = 0; i < gScreenCount; i++) {
+        free(gScreens[i].baseAddr);
+        gScreens[i].baseAddr = NULL;
+    }
+    gScreenCount = 0;
+}
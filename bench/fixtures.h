@@ -0,0 +1,56 @@
+/*
+ * Test fixtures for the host bench: synthetic PixPats, regions and
+ * framebuffers laid out the way the Toolbox would lay them out.
+ */
+
+#ifndef __fixtures__
+#define __fixtures__
+
+#include <Quickdraw.h>
+
+/* Deterministic PRNG so every run sees the same tiles and shapes */
+void FixSeed(unsigned long seed);
+unsigned long FixRandom(void);
+
+/* Monotonic clock in seconds, for timing cases */
+double FixNow(void);
+
+/* Type 1 PixPat with an 8bpp tile and a random 256-entry CLUT */
+PixPatHandle FixNewPixPat(short width, short height);
+
+/*
+ * Same at any PixMap depth (1, 2, 4, 8 indexed with a CLUT of that
+ * size, 16 or 32 direct) with random pixel data
+ */
+PixPatHandle FixNewPixPatDepth(short width, short height, short depth);
+PixPatHandle FixNewUniformPixPat(short width, short height);
+
+/* Old-style (patType 0) and RGB (patType 2) patterns */
+PixPatHandle FixNewOldPixPat(void);
+PixPatHandle FixNewRGBPixPat(void);
+void FixDisposePixPat(PixPatHandle pp);
+
+/*
+ * Region from a mask of width x height bytes (nonzero = inside),
+ * placed with its top-left at (left, top). Produces the same
+ * inversion-point encoding QuickDraw does, including the rectangular
+ * and empty special cases.
+ */
+RgnHandle FixRgnFromMask(const unsigned char *mask, short width, short height,
+                         short left, short top);
+RgnHandle FixRectRgn(short left, short top, short right, short bottom);
+
+/*
+ * Region copied byte for byte out of 68k memory (big-endian shorts,
+ * header included), such as one from a DesktopFix trace
+ */
+RgnHandle FixRgnFromBytes(const unsigned char *bytes, long size);
+void FixDisposeRgn(RgnHandle rgn);
+
+/* Framebuffer for screen slot i of the render core's screen table */
+void FixSetScreen(short i, short width, short height, long rowBytes);
+void FixSetScreenDepth(short i, short width, short height, long rowBytes,
+                       short depth);
+void FixFreeScreens(void);
+
+#endif /* __fixtures__ */
@@ -0,0 +1,97 @@
+/*
+ * Minimal stand-ins for the Toolbox types and calls the rendering core
+ * uses, so render.c builds on a normal host. Field names and meanings
+ * follow Inside Macintosh; layouts only need to agree with render.c,
+ * not with a real Mac.
+ */
+
+#ifndef __MacMock__
+#define __MacMock__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define pascal
+
+typedef unsigned char Boolean;
+typedef char *Ptr;
+typedef Ptr *Handle;
+typedef long Size;
+typedef short OSErr;
+typedef uint32_t OSType;
+typedef uint8_t UInt8;
+typedef uint16_t UInt16;
+typedef uint32_t UInt32;
+typedef int16_t SInt16;
+typedef int32_t SInt32;
+
+typedef struct { UInt32 hi, lo; } UnsignedWide;
+
+enum { noErr = 0 };
+
+typedef struct { short v, h; } Point;
+typedef struct { short top, left, bottom, right; } Rect;
+
+typedef struct { unsigned short red, green, blue; } RGBColor;
+typedef struct { short value; RGBColor rgb; } ColorSpec;
+
+typedef struct {
+    long ctSeed;
+    short ctFlags;
+    short ctSize;
+    ColorSpec ctTable[1];
+} ColorTable, *CTabPtr, **CTabHandle;
+
+/* Region data (inversion points) follows the 10-byte header */
+typedef struct {
+    unsigned short rgnSize;
+    Rect rgnBBox;
+} MacRegion, *RgnPtr, **RgnHandle;
+
+typedef struct {
+    Ptr baseAddr;
+    short rowBytes;
+    Rect bounds;
+    short pmVersion;
+    short packType;
+    long packSize;
+    long hRes, vRes;
+    short pixelType;
+    short pixelSize;
+    short cmpCount;
+    short cmpSize;
+    long planeBytes;
+    CTabHandle pmTable;
+    long pmReserved;
+} PixMap, *PixMapPtr, **PixMapHandle;
+
+typedef struct { UInt8 pat[8]; } Pattern;
+
+typedef struct {
+    short patType;
+    PixMapHandle patMap;
+    Handle patData;
+    Handle patXData;
+    short patXValid;
+    Handle patXMap;
+    Pattern pat1Data;
+} PixPat, *PixPatPtr, **PixPatHandle;
+
+typedef struct GDevice **GDHandle;
+
+/* Memory Manager: plain malloc, handles never move */
+char HGetState(Handle h);
+void HLock(Handle h);
+void HUnlock(Handle h);
+void HSetState(Handle h, char state);
+Ptr NewPtrSys(Size size);
+void DisposePtr(Ptr p);
+void SetPtrSize(Ptr p, Size newSize);
+OSErr MemError(void);
+void BlockMoveData(const void *src, void *dst, Size count);
+
+/* QuickDraw */
+Boolean PtInRgn(Point pt, RgnHandle rgn);
+
+#endif /* __MacMock__ */
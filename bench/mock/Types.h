@@ -0,0 +1 @@
+#include "MacMock.h"
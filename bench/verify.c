@@ -0,0 +1,530 @@
+/*
+ * DesktopFix host verifier - see verify.h
+ *
+ * Every case is a random tile (any kind and depth, random CLUT and
+ * port colors), a random region and rect, a random screen size and
+ * pitch, and half the time a moved port origin and a set of port
+ * clips. Each is drawn through every render path and compared, pixel
+ * for pixel, against a reference that works the way DesktopFix v12
+ * did: PtInRgn on every pixel of the bbox, and the pattern's own data
+ * looked up through its CLUT for each one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fixtures.h"
+#include "render.h"
+#include "arena.h"
+#include "verify.h"
+
+#define kVerifyBacking      (512L * 1024)
+#define kMaxMismatches      10      /* reported in full; the rest are counted */
+#define kSlowdownLimit      0.8     /* of the baseline speedup, before it fails */
+#define kTimedRuns          3       /* each fill is timed this often; the best counts */
+
+/*
+ * Render configurations, each checked on every case: the write modes,
+ * the backing store and the region cache off, at both depths
+ */
+typedef struct {
+    const char *name;
+    short depth;
+    short blitMode;
+    long backing;           /* gBackingBudget */
+    short spanCache;        /* gSpanCacheSize */
+} VerifyMode;
+
+static const VerifyMode kModes[] = {
+    { "direct", 32, kBlitDirect, 0, kSpanCacheEntries },
+    { "staged", 32, kBlitStaged, 0, kSpanCacheEntries },
+    { "backing", 32, kBlitDirect, kVerifyBacking, kSpanCacheEntries },
+    { "nocache", 32, kBlitDirect, 0, 0 },
+    { "d16", 16, kBlitDirect, 0, kSpanCacheEntries },
+    { "d16staged", 16, kBlitStaged, 0, kSpanCacheEntries },
+    { "d16backing", 16, kBlitDirect, kVerifyBacking, kSpanCacheEntries },
+};
+
+#define kModeCount  ((short)(sizeof(kModes) / sizeof(kModes[0])))
+
+/* How a case is handed to the renderer */
+enum { kEntryRgn, kEntryRect, kEntryDefer, kEntryCached, kEntryCount };
+
+static const char *kEntryNames[kEntryCount] = {
+    "rgn", "rect", "defer", "cached"
+};
+
+/*
+ * Totals per mode; the reference is timed at that mode's depth. The
+ * overall rate is swamped by the few cases that fall back to PtInRgn,
+ * so the speed checks use the median of the per-case rates instead.
+ */
+typedef struct {
+    unsigned long pixels;
+    double seconds;
+    unsigned long refPixels;
+    double refSeconds;
+    unsigned long declined;     /* calls that returned false */
+    double *rates;              /* pixels/s of each case drawn, one per case */
+    double *refRates;
+    long rated;
+} ModeTotals;
+
+typedef struct {
+    short width;
+    short height;
+    long pitch32;               /* rowBytes at 32bpp */
+    long pitch16;               /* rowBytes at 16bpp */
+    PixPatHandle pp;
+    RGBColor fore, back;
+    RgnHandle rgn;
+    Rect rect;
+    Point origin;
+    RgnHandle clips[kMaxRenderClips];
+    RenderClip clipSet[kMaxRenderClips];
+    short clipCount;
+} VerifyCase;
+
+static RgnHandle RandomRgn(short maxW, short maxH)
+{
+    short w = 1 + (short)(FixRandom() % maxW);
+    short h = 1 + (short)(FixRandom() % maxH);
+    short left = (short)(FixRandom() % 400) - 100;
+    short top = (short)(FixRandom() % 300) - 100;
+    short kind = (short)(FixRandom() % 3);
+    unsigned char *m = (unsigned char *)malloc((long)w * h);
+    RgnHandle rgn;
+    short x, y;
+
+    /* Solid, ragged, or a checkerboard with lots of inversion points */
+    for (y = 0; y < h; y++)
+        for (x = 0; x < w; x++)
+            m[(long)y * w + x] = kind == 0 ? 1 :
+                                 kind == 1 ? (FixRandom() % 4 != 0) :
+                                 ((x / 7 + y / 5) & 1);
+    rgn = FixRgnFromMask(m, w, h, left, top);
+    free(m);
+    return rgn;
+}
+
+static void RandomColor(RGBColor *c)
+{
+    c->red = (unsigned short)FixRandom();
+    c->green = (unsigned short)FixRandom();
+    c->blue = (unsigned short)FixRandom();
+}
+
+static void BuildCase(VerifyCase *vc)
+{
+    static const short kDepths[] = { 1, 2, 4, 8, 16, 32 };
+    short tileW, tileH, i;
+
+    memset(vc, 0, sizeof(*vc));
+    vc->width = 64 + (short)(FixRandom() % 500);
+    vc->height = 32 + (short)(FixRandom() % 300);
+    vc->pitch32 = vc->width * 4L + (long)(FixRandom() % 3) * 16;
+    vc->pitch16 = vc->width * 2L + (long)(FixRandom() % 3) * 8 +
+                  (long)(FixRandom() % 2) * 2;
+
+    tileW = 1 + (short)(FixRandom() % 130);
+    tileH = 1 + (short)(FixRandom() % 70);
+    switch (FixRandom() % 6) {
+    case 0:
+        vc->pp = FixNewOldPixPat();
+        break;
+    case 1:
+        vc->pp = FixNewRGBPixPat();
+        break;
+    case 2:
+        vc->pp = FixNewUniformPixPat(tileW, tileH);
+        break;
+    default:
+        vc->pp = FixNewPixPatDepth(tileW, tileH, kDepths[FixRandom() % 6]);
+        break;
+    }
+    RandomColor(&vc->fore);
+    RandomColor(&vc->back);
+
+    vc->rgn = RandomRgn(300, 200);
+    vc->rect.left = (short)(FixRandom() % 400) - 100;
+    vc->rect.top = (short)(FixRandom() % 300) - 100;
+    vc->rect.right = vc->rect.left + 1 + (short)(FixRandom() % 300);
+    vc->rect.bottom = vc->rect.top + 1 + (short)(FixRandom() % 200);
+
+    if (FixRandom() & 1) {
+        vc->origin.h = (short)(FixRandom() % 300) - 150;
+        vc->origin.v = (short)(FixRandom() % 300) - 150;
+    }
+
+    /* A visRgn and clipRgn in their own offset coordinates, and a window union */
+    if (FixRandom() & 1) {
+        vc->clips[0] = RandomRgn(500, 350);
+        vc->clips[1] = FixRectRgn(-32767, -32767, 32767, 32767);
+        vc->clips[2] = RandomRgn(300, 250);
+        for (i = 0; i < kMaxRenderClips; i++) {
+            vc->clipSet[i].rgn = vc->clips[i];
+            vc->clipSet[i].dh = (short)(FixRandom() % 60) - 30;
+            vc->clipSet[i].dv = (short)(FixRandom() % 60) - 30;
+            vc->clipSet[i].exclude = i == 2;
+        }
+        vc->clipCount = kMaxRenderClips;
+    }
+}
+
+static void FreeCase(VerifyCase *vc)
+{
+    short i;
+
+    FixDisposePixPat(vc->pp);
+    FixDisposeRgn(vc->rgn);
+    for (i = 0; i < kMaxRenderClips; i++)
+        if (vc->clips[i])
+            FixDisposeRgn(vc->clips[i]);
+}
+
+static UInt32 RGBTo32(const RGBColor *c)
+{
+    return ((UInt32)(c->red >> 8) << 16) | ((UInt32)(c->green >> 8) << 8) |
+           (UInt32)(c->blue >> 8);
+}
+
+/* Pattern pixel at local (x, y), straight from the PixPat, at 32bpp */
+static UInt32 RefPattern(const VerifyCase *vc, short x, short y)
+{
+    PixPatPtr pat = *vc->pp;
+    PixMapPtr pm = *pat->patMap;
+    CTabPtr ct = *pm->pmTable;
+    const unsigned char *row;
+    short w, h, tx, ty, depth, index;
+    unsigned short c16;
+    UInt32 r, g, b;
+
+    if (pat->patType == 0)
+        return (pat->pat1Data.pat[y & 7] & (0x80 >> (x & 7))) ?
+               RGBTo32(&vc->fore) : RGBTo32(&vc->back);
+    if (pat->patType == 2)
+        return RGBTo32(&ct->ctTable[ct->ctSize].rgb);
+
+    w = pm->bounds.right - pm->bounds.left;
+    h = pm->bounds.bottom - pm->bounds.top;
+    tx = (short)(((x % w) + w) % w);
+    ty = (short)(((y % h) + h) % h);
+    row = (const unsigned char *)*pat->patData + (long)ty * (pm->rowBytes & 0x3FFF);
+    depth = pm->pixelSize;
+
+    if (depth == 32)
+        return ((const UInt32 *)row)[tx] & 0x00FFFFFF;
+    if (depth == 16) {
+        c16 = ((const unsigned short *)row)[tx];
+        r = (c16 >> 10) & 0x1F;
+        g = (c16 >> 5) & 0x1F;
+        b = c16 & 0x1F;
+        return (((r << 3) | (r >> 2)) << 16) | (((g << 3) | (g >> 2)) << 8) |
+               ((b << 3) | (b >> 2));
+    }
+
+    index = (row[(long)tx * depth / 8] >> (8 - depth - (tx * depth) % 8)) &
+            ((1 << depth) - 1);
+    return index <= ct->ctSize ? RGBTo32(&ct->ctTable[index].rgb) : 0;
+}
+
+/* Whether global (x, y) survives the port clips */
+static Boolean RefClipped(const VerifyCase *vc, short x, short y)
+{
+    Point pt;
+    short i;
+
+    for (i = 0; i < vc->clipCount; i++) {
+        pt.h = x - vc->clipSet[i].dh;
+        pt.v = y - vc->clipSet[i].dv;
+        if (PtInRgn(pt, vc->clipSet[i].rgn) == vc->clipSet[i].exclude)
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Per-pixel reference of the region (or, with rect, the rect) into a
+ * zeroed buffer laid out like the screen. Returns the pixels written.
+ */
+static unsigned long RenderReference(const VerifyCase *vc, Boolean rect,
+                                     short depth, long rowBytes, Ptr buf)
+{
+    Rect box;
+    Point pt;
+    short x, y;
+    unsigned long pixels = 0;
+    UInt32 c;
+    Boolean inside;
+
+    /* The bbox in global coordinates, clipped to the screen */
+    box = rect ? vc->rect : (**vc->rgn).rgnBBox;
+    box.left = box.left + vc->origin.h < 0 ? 0 : box.left + vc->origin.h;
+    box.top = box.top + vc->origin.v < 0 ? 0 : box.top + vc->origin.v;
+    box.right = box.right + vc->origin.h > vc->width ? vc->width : box.right + vc->origin.h;
+    box.bottom = box.bottom + vc->origin.v > vc->height ? vc->height : box.bottom + vc->origin.v;
+
+    for (y = box.top; y < box.bottom; y++) {
+        for (x = box.left; x < box.right; x++) {
+            pt.h = x - vc->origin.h;
+            pt.v = y - vc->origin.v;
+            inside = rect || PtInRgn(pt, vc->rgn);
+            if (!inside || !RefClipped(vc, x, y))
+                continue;
+
+            c = RefPattern(vc, pt.h, pt.v);
+            if (depth == 16)
+                ((UInt16 *)(buf + (long)y * rowBytes))[x] =
+                    (UInt16)(((c >> 9) & 0x7C00) | ((c >> 6) & 0x03E0) | ((c >> 3) & 0x001F));
+            else
+                ((UInt32 *)(buf + (long)y * rowBytes))[x] = c;
+            pixels++;
+        }
+    }
+    return pixels;
+}
+
+/* Draw one case through one entry into the cleared screen */
+static Boolean RenderEntry(const VerifyCase *vc, short entry)
+{
+    switch (entry) {
+    case kEntryRect:
+        return RenderPatternInRect(&vc->rect, vc->pp);
+    case kEntryDefer:
+        if (!PreparePattern(vc->pp) || !DeferTileInRgn(vc->rgn))
+            return false;
+        return RenderDeferredTile();
+    }
+    return RenderPatternInRgn(vc->rgn, vc->pp);
+}
+
+/* Count a mismatch against the reference, reporting where it starts */
+static void Compare(long caseNum, const VerifyMode *mode, short entry,
+                       const VerifyCase *vc, Ptr want, unsigned long *mismatches)
+{
+    const ScreenInfo *scr = &gScreens[0];
+    short x, y;
+    UInt32 got, exp;
+
+    if (!memcmp(scr->baseAddr, want, scr->rowBytes * vc->height))
+        return;
+
+    if (++*mismatches <= kMaxMismatches) {
+        for (y = 0; y < vc->height; y++) {
+            for (x = 0; x < vc->width; x++) {
+                if (mode->depth == 16) {
+                    got = ((UInt16 *)(scr->baseAddr + (long)y * scr->rowBytes))[x];
+                    exp = ((UInt16 *)(want + (long)y * scr->rowBytes))[x];
+                } else {
+                    got = ((UInt32 *)(scr->baseAddr + (long)y * scr->rowBytes))[x];
+                    exp = ((UInt32 *)(want + (long)y * scr->rowBytes))[x];
+                }
+                if (got != exp) {
+                    printf("MISMATCH case %ld %s/%s at (%d,%d): got %08lx want %08lx\n",
+                           caseNum, mode->name, kEntryNames[entry], x, y,
+                           (unsigned long)got, (unsigned long)exp);
+                    return;
+                }
+            }
+        }
+        /* Only the padding past the last pixel differs */
+        printf("MISMATCH case %ld %s/%s: row padding written\n",
+               caseNum, mode->name, kEntryNames[entry]);
+    }
+}
+
+static void VerifyCaseModes(long caseNum, const VerifyCase *vc, ModeTotals *totals,
+                            unsigned long *mismatches)
+{
+    const VerifyMode *mode;
+    Ptr refRgn = NULL, refRect = NULL;
+    long rowBytes, size;
+    unsigned long pixels, refPixels = 0, casePixels;
+    double start, elapsed, best = 0, refSeconds = 0, caseSeconds;
+    short m, e, run, refDepth = 0;
+
+    SetPatternColors(&vc->fore, &vc->back);
+    for (m = 0; m < kModeCount; m++) {
+        mode = &kModes[m];
+        rowBytes = mode->depth == 16 ? vc->pitch16 : vc->pitch32;
+        size = rowBytes * vc->height;
+
+        gRender16 = mode->depth == 16;
+        gBackingBudget = mode->backing;
+        gSpanCacheSize = mode->spanCache;
+        FixSetScreenDepth(0, vc->width, vc->height, rowBytes, mode->depth);
+        gScreens[0].blitMode = mode->blitMode;
+
+        /* The reference only depends on the depth; every mode at it shares one */
+        if (mode->depth != refDepth) {
+            free(refRgn);
+            free(refRect);
+            refRgn = (Ptr)calloc(1, size);
+            refRect = (Ptr)calloc(1, size);
+            start = FixNow();
+            refPixels = RenderReference(vc, false, mode->depth, rowBytes, refRgn);
+            refPixels += RenderReference(vc, true, mode->depth, rowBytes, refRect);
+            refSeconds = FixNow() - start;
+            refDepth = mode->depth;
+        }
+        totals[m].refSeconds += refSeconds;
+        totals[m].refPixels += refPixels;
+
+        gRenderOrigin = vc->origin;
+        memcpy(gRenderClips, vc->clipSet, sizeof(gRenderClips));
+        gRenderClipCount = vc->clipCount;
+        casePixels = 0;
+        caseSeconds = 0;
+        for (e = 0; e < kEntryCount; e++) {
+            /* Deferred fills take no clips (see RenderRgnOnScreen) */
+            if (e == kEntryDefer && vc->clipCount)
+                continue;
+
+            /*
+             * Time the fill, not the tile expansion; the cached entry
+             * also decodes once first, so the redraw from the region
+             * cache is what gets timed
+             */
+            PreparePattern(vc->pp);
+            if (e == kEntryCached)
+                RenderPatternInRgn(vc->rgn, vc->pp);
+            for (run = 0; run < kTimedRuns; run++) {
+                memset(gScreens[0].baseAddr, 0, size);
+                pixels = gPixelsWritten;
+                start = FixNow();
+                if (!RenderEntry(vc, e))
+                    break;
+                elapsed = FixNow() - start;
+                if (run == 0 || elapsed < best)
+                    best = elapsed;
+            }
+            if (run < kTimedRuns) {
+                /* Left to QuickDraw, which is always correct */
+                totals[m].declined++;
+                continue;
+            }
+            caseSeconds += best;
+            casePixels += gPixelsWritten - pixels;
+            Compare(caseNum, mode, e, vc, e == kEntryRect ? refRect : refRgn,
+                    mismatches);
+        }
+        gRenderClipCount = 0;
+        gRenderOrigin.h = 0;
+        gRenderOrigin.v = 0;
+
+        totals[m].seconds += caseSeconds;
+        totals[m].pixels += casePixels;
+        if (caseSeconds > 0 && refSeconds > 0 && refPixels > 0) {
+            totals[m].rates[totals[m].rated] = casePixels / caseSeconds;
+            totals[m].refRates[totals[m].rated] = refPixels / refSeconds;
+            totals[m].rated++;
+        }
+    }
+    free(refRgn);
+    free(refRect);
+}
+
+static int CompareRates(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Median of n rates, sorting them in place */
+static double MedianRate(double *rates, long n)
+{
+    if (n <= 0)
+        return 0;
+    qsort(rates, n, sizeof(double), CompareRates);
+    return n & 1 ? rates[n / 2] : (rates[n / 2 - 1] + rates[n / 2]) / 2;
+}
+
+/*
+ * Speedup over the reference a mode had in the baseline file, or 0 if
+ * it isn't there. Lines are "mode Mpix/s speedup"; the speedup is what
+ * gets compared, since it holds steady when the whole host is slower.
+ */
+static double BaselineSpeedup(const char *path, const char *name)
+{
+    FILE *f = fopen(path, "r");
+    char line[128], mode[64];
+    double rate, speedup, found = 0;
+
+    if (!f)
+        return 0;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "%63s %lf %lf", mode, &rate, &speedup) == 3 &&
+            !strcmp(mode, name))
+            found = speedup;
+    fclose(f);
+    return found;
+}
+
+int RunVerify(unsigned long seed, long cases, long cacheBudget,
+              const char *baseline, const char *save)
+{
+    VerifyCase vc;
+    ModeTotals totals[kModeCount];
+    unsigned long mismatches = 0, slow = 0;
+    double overall, rate, refRate, speedup, base;
+    FILE *out = NULL;
+    long c;
+    short m;
+
+    if (!ArenaInit(cacheBudget + kVerifyBacking)) {
+        fprintf(stderr, "can't reserve the cache arena\n");
+        return 2;
+    }
+    if (save && !(out = fopen(save, "w"))) {
+        fprintf(stderr, "can't write %s\n", save);
+        return 2;
+    }
+
+    memset(totals, 0, sizeof(totals));
+    for (m = 0; m < kModeCount; m++) {
+        totals[m].rates = (double *)malloc(cases * sizeof(double));
+        totals[m].refRates = (double *)malloc(cases * sizeof(double));
+    }
+    for (c = 0; c < cases; c++) {
+        FixSeed(seed * 104729 + c);
+        BuildCase(&vc);
+        VerifyCaseModes(c, &vc, totals, &mismatches);
+        FreeCase(&vc);
+    }
+    FixFreeScreens();
+
+    printf("%-12s %12s %10s %10s %10s %8s %9s\n", "mode", "pixels", "Mpix/s",
+           "median", "ref median", "speedup", "declined");
+    for (m = 0; m < kModeCount; m++) {
+        overall = totals[m].seconds > 0 ? totals[m].pixels / totals[m].seconds : 0;
+        rate = MedianRate(totals[m].rates, totals[m].rated);
+        refRate = MedianRate(totals[m].refRates, totals[m].rated);
+        speedup = refRate > 0 ? rate / refRate : 0;
+        printf("%-12s %12lu %10.1f %10.1f %10.1f %8.1f %9lu\n", kModes[m].name,
+               totals[m].pixels, overall / 1e6, rate / 1e6, refRate / 1e6,
+               speedup, totals[m].declined);
+        if (out)
+            fprintf(out, "%s %.1f %.2f\n", kModes[m].name, rate / 1e6, speedup);
+
+        /* A fast path slower than per-pixel PtInRgn has lost its point */
+        if (rate < refRate) {
+            printf("SLOW %s: slower than the per-pixel reference\n", kModes[m].name);
+            slow++;
+        }
+        base = baseline ? BaselineSpeedup(baseline, kModes[m].name) : 0;
+        if (base > 0 && speedup < base * kSlowdownLimit) {
+            printf("SLOW %s: %.1fx the reference, baseline %.1fx\n",
+                   kModes[m].name, speedup, base);
+            slow++;
+        }
+        free(totals[m].rates);
+        free(totals[m].refRates);
+    }
+    if (out)
+        fclose(out);
+
+    printf("%ld cases x %d modes x %d entries: %lu mismatched, %lu too slow\n",
+           cases, kModeCount, kEntryCount, mismatches, slow);
+    return mismatches || slow ? 1 : 0;
+}
@@ -0,0 +1,23 @@
+/*
+ * Differential check of the render core for the host bench (-v).
+ *
+ * Draws random cases through every render path and compares each
+ * against a per-pixel reference renderer, bit for bit, then prints the
+ * median per-case throughput of every path next to the reference's.
+ * Fails (returns 1) on any mismatch, on a path slower than the
+ * reference, or with a baseline file, on a path whose speedup over the
+ * reference dropped more than 20% from the one saved there.
+ */
+
+#ifndef __verify__
+#define __verify__
+
+/*
+ * Run cases cases from seed with a cacheBudget byte arena (plus room
+ * for the backing store). baseline, if not NULL, is a file written by
+ * an earlier run's save. Returns the bench's exit status.
+ */
+int RunVerify(unsigned long seed, long cases, long cacheBudget,
+              const char *baseline, const char *save);
+
+#endif /* __verify__ */
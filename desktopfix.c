@@ -18,6 +18,27 @@
  * v12: Read PixPat tile data, render pattern ourselves at 32bpp
  * v13: Clean build - diagnostics removed, confirmed fix
  * v14: Also patch EraseRect (0xA8A3) for icon text rename corruption
+ * v15: Span-based region decoder replaces per-pixel PtInRgn
+ * v16: Cache the pattern tile pre-expanded to 32bpp
+ * v17: Also patch EraseRgn (0xA8D4), sharing the span renderer
+ * v18: Span blitter chosen per CPU (unrolled 020/030, MOVE16 on 040)
+ * v19: Tile rows pre-replicated, y phase stepped per scanline
+ * v20: Optional staged span writes for NuBus video cards
+ * v21: Optional batching of FillCRgn bursts, flushed once per update
+ * v22: Optional screen-wide backing store strip
+ * v23: Old-style and RGB patterns, solid fills for one-color tiles
+ * v24: Tile expander handles 1/2/4/8-bit indexed and 16/32-bit direct
+ * v25: Optional direct rendering to 16bpp screens
+ * v26: Clip repaints to the port's visRgn/clipRgn and the window union
+ * v27: Cache decoded spans of recently repeated regions
+ * v28: Optional trace of recent calls for host-side replay
+ * v29: Read options, trap mask and limits from the 'DsFx' resource
+ * v30: Carve every cache from one system heap arena reserved at startup
+ * v31: Place fills and align the pattern from the port's local origin
+ * v32: Per-thread reentrancy tracking and an interrupt-safe render lock
+ * v33: Optional VBL-synced flush of batched fills
+ * v34: Optional startup timing of the blitters per screen
+ * v35: Reorder the guards cheapest first and count their rejects
  *
  * (c) 2026 - Fixing Apple's homework 30 years later
  */
@@ -27,281 +48,925 @@
 #include <Resources.h>
 #include <OSUtils.h>
 #include <Windows.h>
+#include <Events.h>
 #include <Gestalt.h>
+#include <Timer.h>
+#include <Devices.h>
+#include <Retrace.h>
 #include "ShowInitIcon.h"
+#include "DesktopFixStats.h"
+#include "DesktopFixTrace.h"
+#include "render.h"
+#include "arena.h"
 #include "Retro68Runtime.h"
 
 /* Trap numbers */
 #define kFillCRgnTrap   0xAA12
 #define kEraseRectTrap  0xA8A3
+#define kEraseRgnTrap   0xA8D4  /* not 0xA8A9 - that one double-faults */
+#define kInitGDeviceTrap 0xAA2E
+#define kCalcVisBehindTrap 0xA90A
+#define kPaintBehindTrap 0xA90D
+#define kEndUpdateTrap  0xA923
+#define kGetNextEventTrap 0xA970
+#define kWaitNextEventTrap 0xA860
+
+/* Drawing bottlenecks, patched as flush barriers when batching */
+#define kStdTextTrap    0xA882
+#define kStdLineTrap    0xA890
+#define kStdRectTrap    0xA8A0
+#define kStdRRectTrap   0xA8AF
+#define kStdOvalTrap    0xA8B6
+#define kStdArcTrap     0xA8BD
+#define kStdPolyTrap    0xA8C5
+#define kStdRgnTrap     0xA8D1
+#define kStdBitsTrap    0xA8EB
+#define kCopyMaskTrap   0xA817
+#define kCopyDeepMaskTrap 0xAA51
 
 /* Low-memory globals */
 #define LM_MBarHeight   (*(short *)0x0BAA)
 #define LM_WindowList   (*(WindowPeek *)0x09D6)
+#define LM_GrayRgn      (*(RgnHandle *)0x09EE)
+
+/*
+ * thePort, read the way GetPort does but without the trap dispatch:
+ * the A5 register points at the caller's QuickDraw globals, whose
+ * first entry points at thePort. It has to be the register, not the
+ * CurrentA5 low-memory global - a code resource, completion routine or
+ * another INIT drawing in its own A5 world has its own thePort.
+ */
+static GrafPtr CurrentPort(void)
+{
+#if defined(__m68k__)
+    GrafPtr *thePortPtr;
+
+    __asm__ volatile ("move.l (%%a5),%0" : "=a" (thePortPtr));
+    return *thePortPtr;
+#else
+    GrafPtr port;
+
+    GetPort(&port);
+    return port;
+#endif
+}
 
 /* typedefs for original traps - pascal calling convention */
 typedef pascal void (*FillCRgnProcPtr)(RgnHandle rgn, PixPatHandle pp);
 typedef pascal void (*EraseRectProcPtr)(const Rect *r);
+typedef pascal void (*EraseRgnProcPtr)(RgnHandle rgn);
+typedef pascal void (*InitGDeviceProcPtr)(short qdRefNum, long mode, GDHandle gdh);
+typedef pascal void (*WindowRgnProcPtr)(WindowPtr startWindow, RgnHandle clobberedRgn);
+typedef pascal void (*EndUpdateProcPtr)(WindowPtr theWindow);
+typedef pascal Boolean (*GetNextEventProcPtr)(short eventMask, EventRecord *theEvent);
+typedef pascal Boolean (*WaitNextEventProcPtr)(short eventMask, EventRecord *theEvent,
+                                               unsigned long sleep, RgnHandle mouseRgn);
+typedef pascal void (*StdTextProcPtr)(short byteCount, const void *textBuf,
+                                      Point numer, Point denom);
+typedef pascal void (*StdLineProcPtr)(Point newPt);
+typedef pascal void (*StdRectProcPtr)(GrafVerb verb, const Rect *r);
+typedef pascal void (*StdRRectProcPtr)(GrafVerb verb, const Rect *r,
+                                       short ovalWidth, short ovalHeight);
+typedef pascal void (*StdOvalProcPtr)(GrafVerb verb, const Rect *r);
+typedef pascal void (*StdArcProcPtr)(GrafVerb verb, const Rect *r,
+                                     short startAngle, short arcAngle);
+typedef pascal void (*StdPolyProcPtr)(GrafVerb verb, PolyHandle poly);
+typedef pascal void (*StdRgnProcPtr)(GrafVerb verb, RgnHandle rgn);
+typedef pascal void (*StdBitsProcPtr)(const BitMap *srcBits, const Rect *srcRect,
+                                      const Rect *dstRect, short mode, RgnHandle maskRgn);
+typedef pascal void (*CopyMaskProcPtr)(const BitMap *srcBits, const BitMap *maskBits,
+                                       const BitMap *dstBits, const Rect *srcRect,
+                                       const Rect *maskRect, const Rect *dstRect);
+typedef pascal void (*CopyDeepMaskProcPtr)(const BitMap *srcBits, const BitMap *maskBits,
+                                           const BitMap *dstBits, const Rect *srcRect,
+                                           const Rect *maskRect, const Rect *dstRect,
+                                           short mode, RgnHandle maskRgn);
 
 /* Saved original trap addresses */
 static FillCRgnProcPtr gOldFillCRgn = NULL;
 static EraseRectProcPtr gOldEraseRect = NULL;
+static EraseRgnProcPtr gOldEraseRgn = NULL;
+static InitGDeviceProcPtr gOldInitGDevice = NULL;
+static WindowRgnProcPtr gOldCalcVisBehind = NULL;
+static WindowRgnProcPtr gOldPaintBehind = NULL;
+static EndUpdateProcPtr gOldEndUpdate = NULL;
+static GetNextEventProcPtr gOldGetNextEvent = NULL;
+static WaitNextEventProcPtr gOldWaitNextEvent = NULL;
+static StdTextProcPtr gOldStdText = NULL;
+static StdLineProcPtr gOldStdLine = NULL;
+static StdRectProcPtr gOldStdRect = NULL;
+static StdRRectProcPtr gOldStdRRect = NULL;
+static StdOvalProcPtr gOldStdOval = NULL;
+static StdArcProcPtr gOldStdArc = NULL;
+static StdPolyProcPtr gOldStdPoly = NULL;
+static StdRgnProcPtr gOldStdRgn = NULL;
+static StdBitsProcPtr gOldStdBits = NULL;
+static CopyMaskProcPtr gOldCopyMask = NULL;
+static CopyDeepMaskProcPtr gOldCopyDeepMask = NULL;
+
+/*
+ * Reentrancy.
+ *
+ * The original trap can end up in another patched one (an EraseRgn
+ * inside a FillCRgn, say); those inner calls go straight to QuickDraw.
+ * A nesting depth is all it takes to tell them apart. Thread Manager
+ * threads only switch at Yield and the event calls, never inside
+ * QuickDraw, and preemptive threads can't call the Toolbox at all, so
+ * an open call always belongs to the thread that is running: another
+ * thread's call can't arrive while it is open. Interrupt-time code
+ * never goes through the patches; the VBL flush takes the render lock.
+ */
+static short gPatchDepth = 0;
+
+/*
+ * Render lock: held while anything uses the renderer's shared state
+ * (tile cache, span decoder, arena) or the batch queue. It is taken
+ * with a single BSET, so it is safe against interrupt-time code, and
+ * nobody ever waits on it: a patch that finds it held leaves the call
+ * to QuickDraw, and a flush leaves the batch for the next chance.
+ */
+static volatile unsigned char gRenderLock = 0;
+
+/*
+ * Start a patch call; every one is paired with a LeavePatch. Returns
+ * false if it is nested inside another patched call.
+ */
+static Boolean EnterPatch(void)
+{
+    return gPatchDepth++ == 0;
+}
+
+static void LeavePatch(void)
+{
+    gPatchDepth--;
+}
+
+static Boolean TryRenderLock(void)
+{
+#if defined(__m68k__)
+    unsigned char was;
+
+    /* Old bit 7 lands in Z; one instruction, so no interrupt can split it */
+    __asm__ volatile (
+        "bset #7,%1\n\t"
+        "sne %0"
+        : "=d" (was), "+m" (gRenderLock)
+        :
+        : "cc");
+    return !was;
+#else
+    if (gRenderLock)
+        return false;
+    gRenderLock = 0x80;
+    return true;
+#endif
+}
+
+static void RenderUnlock(void)
+{
+    gRenderLock = 0;
+}
+
+/*
+ * Behavior options. kDefaultOptions applies unless the 'DsFx' tuning
+ * resource (below) says otherwise.
+ *
+ * kOptHeadPatch: run the guards before the original trap and skip it
+ * entirely when we are going to paint the area ourselves. Halves the
+ * VRAM writes per desktop redraw and removes the brief flash of
+ * QuickDraw's garbage, at the cost of trusting our renderer with the
+ * whole area. Off by default; the tail patch is the proven path.
+ *
+ * kOptFullDesktop: with kOptHeadPatch, take over desktop fills of any
+ * size, including the full-screen paint, instead of only the small
+ * redraws QuickDraw gets wrong. Our span fill from the cached tile
+ * beats QuickDraw's own pattern expansion; the target is at least 2x
+ * on a full 1152x870 repaint. Without kOptHeadPatch this would only
+ * paint the whole desktop twice, so it is ignored.
+ *
+ * kOptStagedNuBus: write spans to screens driven from a NuBus slot
+ * through a staging buffer, one BlockMoveData per span (kBlitStaged).
+ * NuBus cards are far slower at scattered longword writes than at
+ * block moves; onboard video is the other way round, so it keeps
+ * direct writes either way.
+ *
+ * kOptBatch: with kOptHeadPatch, qualifying FillCRgns are not painted
+ * right away but unioned into one pending region, which is painted
+ * once when the update ends, at the next event fetch, or just before
+ * anything else draws. Icon drags and rubber-band selections fire
+ * bursts of small overlapping fills; this writes each pixel once per
+ * burst instead of once per fill.
+ *
+ * kOptBackingStore: keep a pre-rendered 32bpp strip of the desktop as
+ * wide as the widest screen, within kBackingBudget bytes of the cache
+ * arena, so every fix is a single straight copy. Rebuilt whenever the
+ * pattern, its CLUT or the screen geometry changes.
+ *
+ * kOpt16Bit: with kOptHeadPatch, also paint desktop fills on 16bpp
+ * (Thousands) screens from a 5-5-5 copy of the tile. QuickDraw gets
+ * those right, so this is only for speed on slower machines; in tail
+ * mode it would just paint everything twice, so it is ignored.
+ *
+ * kOptTrace: record the last kDFTraceEntries patched calls, with a
+ * copy of each region, in a system heap ring published through
+ * Gestalt(kDesktopFixTraceGestalt). DumpTrace saves it to a file that
+ * DesktopFixBench can replay. About 68KB; for tuning, not daily use.
+ *
+ * kOptVBLFlush: with kOptBatch, also paint the pending region from a
+ * VBL task on the main screen's slot, so a burst goes out at the start
+ * of the next frame instead of waiting for the next event fetch, and
+ * never tears mid-frame. The event and drawing flushes stay, so we
+ * still never paint over anything drawn after the fills.
+ *
+ * kOptCalibrate: at startup, time each span copy and direct against
+ * staged writes on a strip of every rendered screen, and keep the
+ * fastest per screen instead of kOptStagedNuBus and the CPU default.
+ * With kOptBackingStore, the backing store is dropped (and its memory
+ * given back) if long runs aren't clearly faster there. Costs a few
+ * tens of milliseconds at boot.
+ */
+#define kOptHeadPatch       0x0001
+#define kOptFullDesktop     0x0002
+#define kOptStagedNuBus     0x0004
+#define kOptBatch           0x0008
+#define kOptBackingStore    0x0010
+#define kOpt16Bit           0x0020
+#define kOptTrace           0x0040
+#define kOptVBLFlush        0x0080
+#define kOptCalibrate       0x0100
+
+#define kBackingBudget      (512L * 1024)
+
+/*
+ * System heap reserved at startup for every cache (tiles, staging,
+ * decoded regions), on top of the backing store budget when that is
+ * on. Enough for the 128x128 watermark at 32 and 16bpp.
+ */
+#define kCacheBudget        (256L * 1024)
+
+#define kDefaultOptions     0
+
+static unsigned long gOptions = kDefaultOptions;
+
+/*
+ * Tuning resource, 'DsFx' 128 in the INIT file (see desktopfix.r).
+ * Read once at startup; when it is missing, short or of another
+ * version, the compiled-in defaults below stay in effect. It lets one
+ * build be tuned per machine - an 030 on onboard video wants direct
+ * writes and no strip, an 040 on a NuBus card staged writes and the
+ * backing store - with ResEdit instead of a rebuild.
+ *
+ * traps has bit (1 << kDFTrap*) set for each drawing trap to patch.
+ * kPolicyAnyFillPort drops the WMgrCPort requirement for FillCRgn;
+ * the window, menu bar and port clip guards still apply. Version 2
+ * added cacheBudget; a version 1 resource is still read.
+ */
+#define kPrefsType          'DsFx'
+#define kPrefsID            128
+#define kPrefsVersion       2
+#define kPrefsV1Size        20
+
+#define kPolicyAnyFillPort  0x0001
+
+typedef struct {
+    short version;              /* kPrefsVersion */
+    unsigned long options;      /* kOpt* bits */
+    unsigned short traps;       /* 1 << kDFTrap* per trap to patch */
+    unsigned short policy;      /* kPolicy* bits */
+    short maxRgnSize;           /* FillCRgn/EraseRgn size cap */
+    short maxRectSize;          /* EraseRect size cap */
+    long backingBudget;         /* bytes, with kOptBackingStore */
+    short spanCacheSize;        /* decoded regions kept, 0 for none */
+    long cacheBudget;           /* bytes for the other caches (v2) */
+} DesktopFixPrefs;
+
+#define kAllTraps           ((1 << kDFTrapCount) - 1)
+
+static unsigned short gTraps = kAllTraps;
+static unsigned short gPolicy = 0;
+
+/*
+ * Performance counters, published through Gestalt(kDesktopFixGestalt).
+ * gPixelsWritten is bumped by the span fill and attributed to a trap
+ * by the StatRender helpers.
+ */
+static DesktopFixStats gStats;
+
+/* Size caps for the small redraws that are always fixed */
+#define kMaxFixRgnSize      250
+#define kMaxFixRectSize     300
+
+static short gMaxFixRgnSize = kMaxFixRgnSize;
+static short gMaxFixRectSize = kMaxFixRectSize;
+static long gBackingBytes = kBackingBudget;
+static long gCacheBytes = kCacheBudget;
 
-/* Recursion guard */
-static short gInPatch = 0;
+/* GDevice gdFlags bits */
+#define kScreenDeviceBit    13
+#define kScreenActiveBit    15
 
-/* Cached screen pixmap info for fast direct access */
-static Ptr gScreenBase = NULL;
-static long gScreenRowBytes = 0;
-static short gScreenWidth = 0;
-static short gScreenHeight = 0;
-static short gScreenReady = 0;
+/* Screen table bookkeeping beyond gScreens in render.c */
+static short gDirectScreens = 0;    /* how many screens we render to */
+static Rect gMainBounds;            /* main screen, for the menu bar test */
 
 /*
- * Cache the screen pixmap parameters from the main GDevice.
- * Always re-validates pixel depth to handle resolution/depth changes.
+ * The table is only rebuilt when something may have changed it:
+ * InitGDevice (every depth or resolution switch goes through it)
+ * clears gScreensValid, and the GrayRgn bbox is kept as a cheap seed
+ * for monitors being added or rearranged. It is also clear for as long
+ * as a rebuild runs, which is what keeps DesktopFixVBL from painting
+ * from a half-written table.
+ */
+static volatile short gScreensValid = 0;
+static Rect gScreensGrayBox;
+
+/* Blitter kOptCalibrate picked for a screen, applied by EnsureScreenInfo */
+typedef struct {
+    GDHandle device;
+    short blitMode;
+    SpanCopyProc spanCopy;  /* NULL for gSpanCopy */
+} CalResult;
+
+static CalResult gCalResults[kMaxScreens];
+static short gCalCount = 0;
+
+/* NuBus slots are $9-$E; onboard video reports slot 0 */
+#define kFirstNuBusSlot     0x09
+#define kLastNuBusSlot      0x0E
+
+/* Slot of a screen's video driver, or -1 if it has no DCE */
+static short DeviceSlot(GDHandle dev)
+{
+    AuxDCEHandle dce;
+
+    dce = (AuxDCEHandle)GetDCtlEntry((**dev).gdRefNum);
+    if (!dce || !*dce)
+        return -1;
+    return (**dce).dCtlSlot;
+}
+
+static Boolean IsNuBusDevice(GDHandle dev)
+{
+    short slot = DeviceSlot(dev);
+
+    return slot >= kFirstNuBusSlot && slot <= kLastNuBusSlot;
+}
+
+/*
+ * Cache the framebuffer parameters of every active screen GDevice.
+ * Returns true if at least one screen is at a depth we render: 32bpp,
+ * or 16bpp as well when gRender16 is set (see IsRenderedDepth).
  */
 static Boolean EnsureScreenInfo(void)
 {
-    GDHandle mainDev;
+    GDHandle dev, mainDev;
     PixMapHandle pmh;
     PixMapPtr pm;
+    ScreenInfo *scr;
+    RgnHandle gray;
+    short i;
+
+    gray = LM_GrayRgn;
+    if (gScreensValid && gray && *gray) {
+        if ((**gray).rgnBBox.top == gScreensGrayBox.top &&
+            (**gray).rgnBBox.left == gScreensGrayBox.left &&
+            (**gray).rgnBBox.bottom == gScreensGrayBox.bottom &&
+            (**gray).rgnBBox.right == gScreensGrayBox.right)
+            return gDirectScreens > 0;
+    }
 
+    gScreensValid = 0;
+    gScreenCount = 0;
+    gDirectScreens = 0;
     mainDev = GetMainDevice();
-    if (!mainDev || !*mainDev) {
-        gScreenReady = 0;
-        return false;
-    }
 
-    pmh = (**mainDev).gdPMap;
-    if (!pmh || !*pmh) {
-        gScreenReady = 0;
-        return false;
-    }
+    for (dev = GetDeviceList(); dev && *dev; dev = (**dev).gdNextGD) {
+        if (!((**dev).gdFlags & (1 << kScreenDeviceBit)) ||
+            !((**dev).gdFlags & (1 << kScreenActiveBit)))
+            continue;
+
+        pmh = (**dev).gdPMap;
+        if (!pmh || !*pmh)
+            continue;
+
+        pm = *pmh;
+        scr = &gScreens[gScreenCount];
+        scr->device = dev;
+        scr->baseAddr = pm->baseAddr;
+        scr->rowBytes = pm->rowBytes & 0x3FFF;
+        scr->bounds = pm->bounds;
+        scr->pixelSize = pm->pixelSize;
+        scr->blitMode = kBlitDirect;
+        scr->spanCopy = NULL;
+        if ((gOptions & kOptStagedNuBus) && IsNuBusDevice(dev))
+            scr->blitMode = kBlitStaged;
+        for (i = 0; i < gCalCount; i++) {
+            if (gCalResults[i].device == dev) {
+                scr->blitMode = gCalResults[i].blitMode;
+                scr->spanCopy = gCalResults[i].spanCopy;
+                break;
+            }
+        }
 
-    pm = *pmh;
-    if (pm->pixelSize != 32) {
-        gScreenReady = 0;
-        return false;
+        if (dev == mainDev)
+            gMainBounds = scr->bounds;
+
+        if (IsRenderedDepth(scr->pixelSize))
+            gDirectScreens++;
+        if (++gScreenCount == kMaxScreens)
+            break;
     }
 
-    gScreenBase = pm->baseAddr;
-    gScreenRowBytes = pm->rowBytes & 0x3FFF;
-    gScreenWidth = pm->bounds.right - pm->bounds.left;
-    gScreenHeight = pm->bounds.bottom - pm->bounds.top;
-    gScreenReady = 1;
-    return true;
+    if (gray && *gray)
+        gScreensGrayBox = (**gray).rgnBBox;
+    gScreensValid = 1;
+    return gDirectScreens > 0;
 }
 
+static void FlushPending(void);
+
 /*
- * Render a PixPat pattern tile directly to the framebuffer inside a region.
- * Reads the pattern's tile data and color table, converts to 32bpp,
- * and writes pixels directly, bypassing QuickDraw entirely.
+ * Patched InitGDevice
  *
- * Only handles type 1 (color pixel pattern) at 8bpp with CLUT.
- * Uses PtInRgn to respect exact region shape.
+ * Called whenever a screen's depth or resolution is (re)set. Before
+ * the original runs, paint any batched fills while the screen they
+ * were queued for is still there, and drop the cached screen table so
+ * nothing renders to a device that is being changed. Drop it again
+ * afterwards so the next qualifying trap rebuilds it from the new mode.
  */
-static void RenderPatternInRgn(RgnHandle rgn, PixPatHandle pp)
+pascal void PatchedInitGDevice(short qdRefNum, long mode, GDHandle gdh)
 {
-    PixMapHandle patMapH;
-    PixMapPtr patMap;
-    Handle patDataH;
-    Ptr patData;
-    CTabHandle ctab;
-    short tileW, tileH, tileRowBytes, tileDepth;
-    Rect bbox;
-    short x, y, tx, ty;
-    short left, top, right, bottom;
-    unsigned long *rowPtr;
-    Point pt;
-    unsigned char pixVal;
-    ColorSpec *cs;
-    unsigned long pixel32;
-    char patMapState, patDataState, ctabState;
-
-    if (!pp || !*pp)
-        return;
+    FlushPending();
+    gScreensValid = 0;
+    gOldInitGDevice(qdRefNum, mode, gdh);
+    gScreensValid = 0;
+}
 
-    /* Only handle type 1 (color pixel pattern) */
-    if ((**pp).patType != 1)
-        return;
+/*
+ * Add the time since start to an accumulated microsecond count.
+ * Only the low word of the delta is used; no single call runs for
+ * 71 minutes.
+ */
+static void StatsAddMicros(UnsignedWide *acc, const UnsignedWide *start)
+{
+    UnsignedWide now;
+    unsigned long lo;
+
+    Microseconds(&now);
+    lo = acc->lo + (now.lo - start->lo);
+    if (lo < acc->lo)
+        acc->hi++;
+    acc->lo = lo;
+}
 
-    patMapH = (**pp).patMap;
-    patDataH = (**pp).patData;
-    if (!patMapH || !*patMapH || !patDataH || !*patDataH)
-        return;
+/*
+ * Old-style patterns are drawn in the current port's colors, which the
+ * render core can't look up itself.
+ */
+static void NotePatternColors(PixPatHandle pp)
+{
+    RGBColor fore, back;
 
-    /* Lock handles to prevent movement during rendering */
-    patMapState = HGetState((Handle)patMapH);
-    HLock((Handle)patMapH);
-    patDataState = HGetState(patDataH);
-    HLock(patDataH);
+    if (pp && *pp && (**pp).patType == 0) {
+        GetForeColor(&fore);
+        GetBackColor(&back);
+        SetPatternColors(&fore, &back);
+    }
+}
 
-    patMap = *patMapH;
-    patData = *patDataH;
+/*
+ * Renderer wrappers that charge time and pixels to a trap's counters.
+ */
+static Boolean StatRenderRgn(DFTrapStats *st, RgnHandle rgn, PixPatHandle pp)
+{
+    UnsignedWide start;
+    unsigned long pixels;
+    Boolean done;
 
-    tileW = patMap->bounds.right - patMap->bounds.left;
-    tileH = patMap->bounds.bottom - patMap->bounds.top;
-    tileRowBytes = patMap->rowBytes & 0x3FFF;
-    tileDepth = patMap->pixelSize;
+    if (!TryRenderLock())
+        return false;
 
-    if (tileW <= 0 || tileH <= 0 || tileDepth != 8) {
-        HSetState((Handle)patMapH, patMapState);
-        HSetState(patDataH, patDataState);
-        return;
-    }
+    NotePatternColors(pp);
+    pixels = gPixelsWritten;
+    Microseconds(&start);
+    done = RenderPatternInRgn(rgn, pp);
+    StatsAddMicros(&st->renderMicros, &start);
+    st->pixels += gPixelsWritten - pixels;
+    RenderUnlock();
+    return done;
+}
 
-    ctab = patMap->pmTable;
-    if (!ctab || !*ctab) {
-        HSetState((Handle)patMapH, patMapState);
-        HSetState(patDataH, patDataState);
-        return;
-    }
+static Boolean StatRenderRect(DFTrapStats *st, const Rect *r, PixPatHandle pp)
+{
+    UnsignedWide start;
+    unsigned long pixels;
+    Boolean done;
+
+    if (!TryRenderLock())
+        return false;
 
-    ctabState = HGetState((Handle)ctab);
-    HLock((Handle)ctab);
+    NotePatternColors(pp);
+    pixels = gPixelsWritten;
+    Microseconds(&start);
+    done = RenderPatternInRect(r, pp);
+    StatsAddMicros(&st->renderMicros, &start);
+    st->pixels += gPixelsWritten - pixels;
+    RenderUnlock();
+    return done;
+}
 
-    /* Get region bounding box and clip to screen */
-    bbox = (**rgn).rgnBBox;
-    left = bbox.left;
-    top = bbox.top;
-    right = bbox.right;
-    bottom = bbox.bottom;
-
-    if (left < 0) left = 0;
-    if (top < 0) top = 0;
-    if (right > gScreenWidth) right = gScreenWidth;
-    if (bottom > gScreenHeight) bottom = gScreenHeight;
-
-    if (left < right && top < bottom) {
-        for (y = top; y < bottom; y++) {
-            rowPtr = (unsigned long *)(gScreenBase + (long)y * gScreenRowBytes);
-            pt.v = y;
-            ty = y % tileH;
-            if (ty < 0) ty += tileH;
-
-            for (x = left; x < right; x++) {
-                pt.h = x;
-                if (PtInRgn(pt, rgn)) {
-                    tx = x % tileW;
-                    if (tx < 0) tx += tileW;
-
-                    /* Read 8bpp pixel value from pattern tile */
-                    pixVal = *((unsigned char *)patData + ty * tileRowBytes + tx);
-
-                    /* Look up in color table and convert to 32bpp */
-                    cs = &(**ctab).ctTable[pixVal];
-                    pixel32 = ((unsigned long)(cs->rgb.red >> 8) << 16) |
-                              ((unsigned long)(cs->rgb.green >> 8) << 8) |
-                              (unsigned long)(cs->rgb.blue >> 8);
-
-                    rowPtr[x] = pixel32;
-                }
-            }
+/*
+ * Gestalt selector function for kDesktopFixGestalt: hand out the
+ * address of the live stats block.
+ */
+pascal OSErr DesktopFixGestalt(OSType selector, long *response)
+{
+    *response = (long)&gStats;
+    return noErr;
+}
+
+/*
+ * Call trace (kOptTrace), published through
+ * Gestalt(kDesktopFixTraceGestalt). NULL when tracing is off, which is
+ * all the patches test.
+ */
+static DesktopFixTrace *gTrace = NULL;
+
+pascal OSErr DesktopFixTraceGestalt(OSType selector, long *response)
+{
+    *response = (long)gTrace;
+    return noErr;
+}
+
+/*
+ * Record one top-level patched call. r is the rect for EraseRect and
+ * NULL for the region traps; start is when the patch was entered.
+ * Regions too big for an entry keep only their bbox and size.
+ */
+static void TraceCall(short trap, const Rect *r, RgnHandle rgn,
+                      Boolean qualified, const UnsignedWide *start)
+{
+    DFTraceEntry *e;
+    UnsignedWide now;
+    GrafPtr port;
+    short size;
+
+    Microseconds(&now);
+    e = &gTrace->entries[gTrace->next % kDFTraceEntries];
+    gTrace->next++;
+
+    GetPort(&port);
+    e->trap = trap;
+    e->flags = qualified ? kDFTraceQualified : 0;
+    e->port = (long)port;
+    e->micros = now.lo - start->lo;
+    e->rgnSize = 0;
+    e->rgnBytes = 0;
+
+    if (rgn && *rgn) {
+        e->bounds = (**rgn).rgnBBox;
+        e->rgnSize = (**rgn).rgnSize;
+        size = e->rgnSize;
+        if (e->rgnSize > kDFTraceRgnBytes) {
+            e->flags |= kDFTraceRgnTooBig;
+            size = 0;
         }
+        BlockMoveData(*rgn, e->rgnData, size);
+        e->rgnBytes = size;
+    } else if (r) {
+        e->bounds = *r;
+    } else {
+        SetRect(&e->bounds, 0, 0, 0, 0);
     }
+}
+
+/*
+ * Batched FillCRgn (kOptBatch).
+ *
+ * Qualifying fills collect in gPendingRgn, all for the tile cached
+ * from gPendingPP, and are painted by FlushPending. The pending area
+ * was already checked against the windows and must not outlive
+ * anything that could draw over it, so FlushPending runs:
+ *
+ *   - at EndUpdate and at GetNextEvent/WaitNextEvent,
+ *   - before any other drawing, from head patches on the QuickDraw
+ *     bottlenecks (StdText, StdLine, StdRect, StdRRect, StdOval,
+ *     StdArc, StdPoly, StdRgn, StdBits) and on CopyMask/CopyDeepMask,
+ *     which don't go through StdBits,
+ *   - before window geometry or screen setup changes, and before any
+ *     of our own patches renders something else.
+ *
+ * The barrier patches are only installed when batching is on.
+ */
+static RgnHandle gPendingRgn = NULL;
+static PixPatHandle gPendingPP = NULL;
+static Boolean gPending = false;
 
-    /* Restore handle states */
-    HSetState((Handle)ctab, ctabState);
-    HSetState((Handle)patMapH, patMapState);
-    HSetState(patDataH, patDataState);
+/*
+ * With kOptVBLFlush the VBL task paints the spans DeferTileInRgn took
+ * of gPendingRgn. It can't empty the region itself, so it leaves
+ * gPendingPainted for the next task-level caller holding the lock.
+ */
+static VBLTask gVBLTask;
+static Boolean gPendingPainted = false;
+
+static void ForgetPainted(void)
+{
+    if (gPendingPainted) {
+        SetEmptyRgn(gPendingRgn);
+        gPendingPainted = false;
+    }
 }
 
 /*
- * Render a PixPat pattern tile directly to the framebuffer inside a rect.
- * Same as RenderPatternInRgn but for rectangles (no PtInRgn needed).
+ * Paint the queue with the render lock held: from gPendingRgn, or at
+ * interrupt time from its deferred spans. Returns false if there was
+ * nothing it could paint.
  */
-static void RenderPatternInRect(const Rect *r, PixPatHandle pp)
+static Boolean PaintPending(Boolean deferred)
 {
-    PixMapHandle patMapH;
-    PixMapPtr patMap;
-    Handle patDataH;
-    Ptr patData;
-    CTabHandle ctab;
-    short tileW, tileH, tileRowBytes, tileDepth;
-    short x, y, tx, ty;
-    short left, top, right, bottom;
-    unsigned long *rowPtr;
-    unsigned char pixVal;
-    ColorSpec *cs;
-    unsigned long pixel32;
-    char patMapState, patDataState, ctabState;
+    DFTrapStats *st = &gStats.traps[kDFTrapFillCRgn];
+    UnsignedWide start;
+    unsigned long pixels;
+    short clips;
+    Point origin;
+    Boolean done = true;
+
+    /*
+     * The tile still holds gPendingPP; anything else would have flushed.
+     * Queued fills were clipped to their port's visRgn and clipRgn as
+     * they were queued, all in global coordinates clear of the windows,
+     * so they go out without the current call's port setup.
+     */
+    clips = gRenderClipCount;
+    origin = gRenderOrigin;
+    gRenderClipCount = 0;
+    gRenderOrigin.h = 0;
+    gRenderOrigin.v = 0;
+    pixels = gPixelsWritten;
+    Microseconds(&start);
+    if (deferred)
+        done = RenderDeferredTile();
+    else
+        RenderTileInRgn(gPendingRgn);
+    StatsAddMicros(&st->renderMicros, &start);
+    st->pixels += gPixelsWritten - pixels;
+    gRenderClipCount = clips;
+    gRenderOrigin = origin;
+
+    if (done) {
+        gPending = false;
+        gPendingPP = NULL;
+    }
+    return done;
+}
 
-    if (!pp || !*pp)
+static void FlushPending(void)
+{
+    if ((!gPending && !gPendingPainted) || !TryRenderLock())
         return;
 
-    if ((**pp).patType != 1)
-        return;
+    ForgetPainted();
+    if (gPending) {
+        PaintPending(false);
+        SetEmptyRgn(gPendingRgn);
+        CancelDeferredTile();
+    }
+    RenderUnlock();
+}
+
+/*
+ * VBL task for kOptVBLFlush. Runs every frame; does nothing unless
+ * fills are queued, the screen table is current and no task-level
+ * code is in the middle of using the renderer.
+ */
+static void DesktopFixVBL(void)
+{
+    gVBLTask.vblCount = 1;
 
-    patMapH = (**pp).patMap;
-    patDataH = (**pp).patData;
-    if (!patMapH || !*patMapH || !patDataH || !*patDataH)
+    if (!gPending || !gScreensValid || !TryRenderLock())
         return;
+    if (PaintPending(true))
+        gPendingPainted = true;
+    RenderUnlock();
+}
 
-    patMapState = HGetState((Handle)patMapH);
-    HLock((Handle)patMapH);
-    patDataState = HGetState(patDataH);
-    HLock(patDataH);
+/*
+ * Run DesktopFixVBL off the main screen's own retrace, or the system
+ * VBL if its slot won't take the task. Without either kOptVBLFlush is
+ * dropped.
+ */
+static void InstallVBLFlush(void)
+{
+    short slot = DeviceSlot(GetMainDevice());
+
+    gVBLTask.qType = vType;
+    gVBLTask.vblAddr = (VBLUPP)DesktopFixVBL;
+    gVBLTask.vblCount = 1;
+    gVBLTask.vblPhase = 0;
+    if ((slot < 0 || SlotVInstall((QElemPtr)&gVBLTask, slot) != noErr) &&
+        VInstall((QElemPtr)&gVBLTask) != noErr)
+        gOptions &= ~kOptVBLFlush;
+}
 
-    patMap = *patMapH;
-    patData = *patDataH;
+/* Scratch region for the window guard and the batch queue */
+static RgnHandle gScratchRgn = NULL;
 
-    tileW = patMap->bounds.right - patMap->bounds.left;
-    tileH = patMap->bounds.bottom - patMap->bounds.top;
-    tileRowBytes = patMap->rowBytes & 0x3FFF;
-    tileDepth = patMap->pixelSize;
+/*
+ * Queue a qualifying FillCRgn. Returns false if it has to be painted
+ * now instead: the pattern can't be rendered, or the union failed.
+ * Old-style patterns aren't batched, since the port colors they are
+ * drawn in could change before the flush, and neither are fills from a
+ * port with its origin moved, since the queue is kept in global terms.
+ *
+ * Only the part of the fill inside the current render clips is queued:
+ * the flush paints without them, and a fill clipped to part of an icon
+ * during an update must not repaint the rest of it.
+ */
+static Boolean QueueFill(RgnHandle rgn, PixPatHandle pp)
+{
+    OSErr err;
+    short i;
 
-    if (tileW <= 0 || tileH <= 0 || tileDepth != 8) {
-        HSetState((Handle)patMapH, patMapState);
-        HSetState(patDataH, patDataState);
-        return;
+    if (!gPendingRgn || !gScratchRgn || !pp || !*pp || (**pp).patType == 0 ||
+        gRenderOrigin.h || gRenderOrigin.v)
+        return false;
+    for (i = 0; i < gRenderClipCount; i++)
+        if (gRenderClips[i].dh || gRenderClips[i].dv)
+            return false;
+
+    if (pp != gPendingPP)
+        FlushPending();
+
+    if (!TryRenderLock())
+        return false;
+    ForgetPainted();
+    if (!PreparePattern(pp)) {
+        RenderUnlock();
+        return false;
     }
 
-    ctab = patMap->pmTable;
-    if (!ctab || !*ctab) {
-        HSetState((Handle)patMapH, patMapState);
-        HSetState(patDataH, patDataState);
-        return;
+    /* With the origin at (0,0) the clips are already in global terms */
+    CopyRgn(rgn, gScratchRgn);
+    err = QDError();
+    for (i = 0; i < gRenderClipCount && err == noErr; i++) {
+        if (gRenderClips[i].exclude)
+            DiffRgn(gScratchRgn, gRenderClips[i].rgn, gScratchRgn);
+        else
+            SectRgn(gScratchRgn, gRenderClips[i].rgn, gScratchRgn);
+        err = QDError();
+    }
+    if (err != noErr) {
+        RenderUnlock();
+        return false;
     }
 
-    ctabState = HGetState((Handle)ctab);
-    HLock((Handle)ctab);
+    UnionRgn(gPendingRgn, gScratchRgn, gPendingRgn);
+    if (QDError() != noErr) {
+        /* Whatever made it in is still good; paint it and start over */
+        gPending = true;
+        RenderUnlock();
+        FlushPending();
+        return false;
+    }
 
-    /* Clip to screen */
-    left = r->left;
-    top = r->top;
-    right = r->right;
-    bottom = r->bottom;
+    /* Without a snapshot the VBL task just leaves it to FlushPending */
+    if (gOptions & kOptVBLFlush)
+        DeferTileInRgn(gPendingRgn);
+    gPendingPP = pp;
+    gPending = true;
+    RenderUnlock();
+    return true;
+}
 
-    if (left < 0) left = 0;
-    if (top < 0) top = 0;
-    if (right > gScreenWidth) right = gScreenWidth;
-    if (bottom > gScreenHeight) bottom = gScreenHeight;
+/* Copy the cache arena's numbers into the stats block */
+static void NoteCacheUsage(void)
+{
+    gStats.cacheBudget = gArenaSize;
+    gStats.cacheResident = gArenaUsed;
+    gStats.cachePurges = gArenaPurges;
+}
 
-    if (left < right && top < bottom) {
-        for (y = top; y < bottom; y++) {
-            rowPtr = (unsigned long *)(gScreenBase + (long)y * gScreenRowBytes);
-            ty = y % tileH;
-            if (ty < 0) ty += tileH;
+/*
+ * System heap grow zone hook.
+ *
+ * Runs when the system heap can't satisfy an allocation. The system's
+ * own grow zone proc goes first, since it can usually just grow the
+ * heap; only if it can't do we give up cache memory, largest caches
+ * first. Nothing is trimmed while the renderer is in use or a batched
+ * fill is waiting on the cached tile.
+ */
+static GrowZoneUPP gOldSysGrowZone = NULL;
 
-            for (x = left; x < right; x++) {
-                tx = x % tileW;
-                if (tx < 0) tx += tileW;
+pascal long DesktopFixGrowZone(Size cbNeeded)
+{
+    long freed = 0;
 
-                pixVal = *((unsigned char *)patData + ty * tileRowBytes + tx);
-                cs = &(**ctab).ctTable[pixVal];
-                pixel32 = ((unsigned long)(cs->rgb.red >> 8) << 16) |
-                          ((unsigned long)(cs->rgb.green >> 8) << 8) |
-                          (unsigned long)(cs->rgb.blue >> 8);
+    if (gOldSysGrowZone)
+        freed = gOldSysGrowZone(cbNeeded);
 
-                rowPtr[x] = pixel32;
-            }
-        }
+    if (freed == 0 && !gPending && TryRenderLock()) {
+        freed = ArenaTrim(cbNeeded);
+        gStats.cacheTrimmed += freed;
+        NoteCacheUsage();
+        RenderUnlock();
     }
+    return freed;
+}
+
+pascal void PatchedEndUpdate(WindowPtr theWindow)
+{
+    FlushPending();
+    gOldEndUpdate(theWindow);
+}
+
+pascal Boolean PatchedGetNextEvent(short eventMask, EventRecord *theEvent)
+{
+    FlushPending();
+    return gOldGetNextEvent(eventMask, theEvent);
+}
+
+pascal Boolean PatchedWaitNextEvent(short eventMask, EventRecord *theEvent,
+                                    unsigned long sleep, RgnHandle mouseRgn)
+{
+    FlushPending();
+    return gOldWaitNextEvent(eventMask, theEvent, sleep, mouseRgn);
+}
+
+pascal void BarrierStdText(short byteCount, const void *textBuf,
+                           Point numer, Point denom)
+{
+    FlushPending();
+    gOldStdText(byteCount, textBuf, numer, denom);
+}
+
+pascal void BarrierStdLine(Point newPt)
+{
+    FlushPending();
+    gOldStdLine(newPt);
+}
+
+pascal void BarrierStdRect(GrafVerb verb, const Rect *r)
+{
+    FlushPending();
+    gOldStdRect(verb, r);
+}
+
+pascal void BarrierStdRRect(GrafVerb verb, const Rect *r,
+                            short ovalWidth, short ovalHeight)
+{
+    FlushPending();
+    gOldStdRRect(verb, r, ovalWidth, ovalHeight);
+}
+
+pascal void BarrierStdOval(GrafVerb verb, const Rect *r)
+{
+    FlushPending();
+    gOldStdOval(verb, r);
+}
+
+pascal void BarrierStdArc(GrafVerb verb, const Rect *r,
+                          short startAngle, short arcAngle)
+{
+    FlushPending();
+    gOldStdArc(verb, r, startAngle, arcAngle);
+}
 
-    HSetState((Handle)ctab, ctabState);
-    HSetState((Handle)patMapH, patMapState);
-    HSetState(patDataH, patDataState);
+pascal void BarrierStdPoly(GrafVerb verb, PolyHandle poly)
+{
+    FlushPending();
+    gOldStdPoly(verb, poly);
+}
+
+pascal void BarrierStdRgn(GrafVerb verb, RgnHandle rgn)
+{
+    FlushPending();
+    gOldStdRgn(verb, rgn);
+}
+
+pascal void BarrierStdBits(const BitMap *srcBits, const Rect *srcRect,
+                           const Rect *dstRect, short mode, RgnHandle maskRgn)
+{
+    FlushPending();
+    gOldStdBits(srcBits, srcRect, dstRect, mode, maskRgn);
+}
+
+pascal void BarrierCopyMask(const BitMap *srcBits, const BitMap *maskBits,
+                            const BitMap *dstBits, const Rect *srcRect,
+                            const Rect *maskRect, const Rect *dstRect)
+{
+    FlushPending();
+    gOldCopyMask(srcBits, maskBits, dstBits, srcRect, maskRect, dstRect);
+}
+
+pascal void BarrierCopyDeepMask(const BitMap *srcBits, const BitMap *maskBits,
+                                const BitMap *dstBits, const Rect *srcRect,
+                                const Rect *maskRect, const Rect *dstRect,
+                                short mode, RgnHandle maskRgn)
+{
+    FlushPending();
+    gOldCopyDeepMask(srcBits, maskBits, dstBits, srcRect, maskRect, dstRect,
+                     mode, maskRgn);
 }
 
 /*
@@ -312,31 +977,318 @@ static Boolean IsWMgrDraw(void)
     GrafPtr currentPort;
     CGrafPtr wmPort;
 
-    GetPort(&currentPort);
+    currentPort = CurrentPort();
     wmPort = *(CGrafPtr *)0x0D2C;
 
     return (currentPort == (GrafPtr)wmPort);
 }
 
 /*
- * Check if a rect overlaps any window's structure region,
- * excluding the last window (the desktop window).
+ * Union of every window's structure region, excluding the last window
+ * (the desktop window).
+ *
+ * Rebuilt lazily when gWinSeed moves. The Window Manager goes through
+ * CalcVisBehind and PaintBehind whenever a window is shown, hidden,
+ * moved, resized or disposed, so patching those two is enough to bump
+ * the seed. The window list head is compared too, to catch windows
+ * created invisible.
+ */
+static RgnHandle gWinRgn = NULL;
+static unsigned long gWinSeed = 1;
+static unsigned long gWinRgnSeed = 0;
+static WindowPeek gWinRgnHead = NULL;
+
+/*
+ * Bring gWinRgn up to date. Returns false if it couldn't be built
+ * (no memory), in which case nothing is fixed.
  */
-static Boolean IsRectInAnyWindowStruc(const Rect *r)
+static Boolean EnsureWindowRgn(void)
 {
     WindowPeek win;
 
-    win = LM_WindowList;
-    while (win) {
-        if (!win->nextWindow)
-            break;
+    if (!gWinRgn)
+        return false;
+
+    if (gWinRgnSeed == gWinSeed && gWinRgnHead == LM_WindowList)
+        return true;
+
+    SetEmptyRgn(gWinRgn);
+    for (win = LM_WindowList; win && win->nextWindow; win = win->nextWindow) {
         if (win->strucRgn && *win->strucRgn) {
-            if (RectInRgn(r, win->strucRgn))
-                return true;
+            UnionRgn(gWinRgn, win->strucRgn, gWinRgn);
+            if (QDError() != noErr) {
+                gWinRgnSeed = 0;
+                return false;
+            }
+        }
+    }
+
+    gWinRgnSeed = gWinSeed;
+    gWinRgnHead = LM_WindowList;
+    return true;
+}
+
+/*
+ * How much of an area the windows' structure regions cover.
+ */
+enum {
+    kWinNone = 0,       /* clear of every window */
+    kWinPartial,        /* some of it is under a window */
+    kWinAll             /* all of it is, or we can't tell */
+};
+
+/*
+ * Classify a region (or a rect, if rgn is NULL) against the cached
+ * window union, excluding the last window (the desktop window).
+ * Usually a single rect test against the union's bbox. If the union
+ * can't be built the area is treated as covered and left alone.
+ *
+ * r is global; rgn is in the port's local coordinates, gRenderOrigin
+ * away, so the union is moved over to it for the region arithmetic.
+ */
+static short WindowOverlap(RgnHandle rgn, const Rect *r)
+{
+    Rect *box;
+    OSErr err;
+
+    if (!gScratchRgn || !EnsureWindowRgn())
+        return kWinAll;
+
+    box = &(**gWinRgn).rgnBBox;
+    if (r->left >= box->right || r->right <= box->left ||
+        r->top >= box->bottom || r->bottom <= box->top)
+        return kWinNone;
+
+    if (rgn) {
+        OffsetRgn(gWinRgn, -gRenderOrigin.h, -gRenderOrigin.v);
+        SectRgn(rgn, gWinRgn, gScratchRgn);
+        err = QDError();
+        if (err == noErr && EmptyRgn(gScratchRgn)) {
+            OffsetRgn(gWinRgn, gRenderOrigin.h, gRenderOrigin.v);
+            return kWinNone;
+        }
+        if (err == noErr) {
+            DiffRgn(rgn, gWinRgn, gScratchRgn);
+            err = QDError();
         }
-        win = win->nextWindow;
+        OffsetRgn(gWinRgn, gRenderOrigin.h, gRenderOrigin.v);
+    } else {
+        if (!RectInRgn(r, gWinRgn))
+            return kWinNone;
+        RectRgn(gScratchRgn, r);
+        DiffRgn(gScratchRgn, gWinRgn, gScratchRgn);
+        err = QDError();
+    }
+    if (err != noErr || EmptyRgn(gScratchRgn))
+        return kWinAll;
+    return kWinPartial;
+}
+
+/*
+ * Set the next render up for the current port: gRenderOrigin from
+ * where its local coordinates sit on the screen, so the fill lands and
+ * the pattern lines up where QuickDraw would put them, and its visRgn
+ * and clipRgn as clips. Returns false if the port doesn't draw to a
+ * screen we know (an offscreen GWorld, say), in which case there is
+ * nothing for us to paint. EndPortClip clears it all again.
+ */
+static Boolean BeginPortClip(void)
+{
+    GrafPtr port;
+    CGrafPtr cport;
+    PixMapHandle pm;
+    Ptr base;
+    Rect bounds;
+    short i;
+
+    gRenderClipCount = 0;
+
+    port = CurrentPort();
+    if (!port || !port->visRgn || !*port->visRgn ||
+        !port->clipRgn || !*port->clipRgn)
+        return false;
+
+    cport = (CGrafPtr)port;
+    if ((cport->portVersion & 0xC000) == 0xC000) {
+        pm = cport->portPixMap;
+        if (!pm || !*pm)
+            return false;
+        base = (**pm).baseAddr;
+        bounds = (**pm).bounds;
+    } else {
+        base = port->portBits.baseAddr;
+        bounds = port->portBits.bounds;
+    }
+
+    for (i = 0; i < gScreenCount; i++) {
+        if (gScreens[i].baseAddr == base)
+            break;
+    }
+    if (i == gScreenCount)
+        return false;
+
+    /* Local (bounds.left, bounds.top) is the screen's top-left pixel */
+    gRenderOrigin.h = gScreens[i].bounds.left - bounds.left;
+    gRenderOrigin.v = gScreens[i].bounds.top - bounds.top;
+
+    gRenderClips[0].rgn = port->visRgn;
+    gRenderClips[0].dh = gRenderOrigin.h;
+    gRenderClips[0].dv = gRenderOrigin.v;
+    gRenderClips[0].exclude = false;
+    gRenderClips[1] = gRenderClips[0];
+    gRenderClips[1].rgn = port->clipRgn;
+    gRenderClipCount = 2;
+    return true;
+}
+
+/* Also keep the render out from under the windows */
+static void ClipOutWindows(void)
+{
+    gRenderClips[2].rgn = gWinRgn;
+    gRenderClips[2].dh = 0;
+    gRenderClips[2].dv = 0;
+    gRenderClips[2].exclude = true;
+    gRenderClipCount = 3;
+}
+
+static void EndPortClip(void)
+{
+    gRenderClipCount = 0;
+    gRenderOrigin.h = 0;
+    gRenderOrigin.v = 0;
+}
+
+/*
+ * Size test shared by the guards: at least 1px each way, and within
+ * cap unless the full-desktop fast path is on.
+ */
+static Boolean IsFixSize(const Rect *r, short cap)
+{
+    short w = r->right - r->left;
+    short h = r->bottom - r->top;
+
+    if (w < 1 || h < 1)
+        return false;
+    if ((gOptions & (kOptHeadPatch | kOptFullDesktop)) ==
+        (kOptHeadPatch | kOptFullDesktop))
+        return true;
+    return w <= cap && h <= cap;
+}
+
+/*
+ * Patched CalcVisBehind / PaintBehind
+ *
+ * Window geometry is changing: invalidate the cached window union.
+ * Bumped on both sides of the call, since PaintBehind draws the
+ * desktop (through our FillCRgn) with the new geometry already set.
+ */
+pascal void PatchedCalcVisBehind(WindowPtr startWindow, RgnHandle clobberedRgn)
+{
+    FlushPending();
+    gWinSeed++;
+    gOldCalcVisBehind(startWindow, clobberedRgn);
+    gWinSeed++;
+}
+
+pascal void PatchedPaintBehind(WindowPtr startWindow, RgnHandle clobberedRgn)
+{
+    FlushPending();
+    gWinSeed++;
+    gOldPaintBehind(startWindow, clobberedRgn);
+    gWinSeed++;
+}
+
+/*
+ * Check that a rect, in the current port's local coordinates, touches
+ * no screen we don't render to. In head patch mode anything we can't
+ * paint ourselves must go to QuickDraw; parts that fall between
+ * screens are never drawn by anyone.
+ */
+static Boolean IsRectOnDirectScreens(const Rect *r)
+{
+    Rect global, clip;
+    short i;
+
+    global = *r;
+    OffsetRect(&global, gRenderOrigin.h, gRenderOrigin.v);
+    for (i = 0; i < gScreenCount; i++) {
+        if (!IsRenderedDepth(gScreens[i].pixelSize) &&
+            ClipToScreen(&global, &gScreens[i], &clip))
+            return false;
     }
-    return false;
+    return true;
+}
+
+/*
+ * Check if a rect reaches into the menu bar on the main screen.
+ * LM_MBarHeight is read live since menu bar hiders change it.
+ */
+static Boolean IsRectInMenuBar(const Rect *r)
+{
+    return r->top < gMainBounds.top + LM_MBarHeight &&
+           r->bottom > gMainBounds.top &&
+           r->left < gMainBounds.right && r->right > gMainBounds.left;
+}
+
+/*
+ * The guards return the kDFReject* code of the first one that failed,
+ * for the counters, or kGuardPassed. They run cheapest and most
+ * selective first: plain arithmetic on the rect, then reads of the
+ * port, and only then anything that walks the screens or the windows.
+ */
+#define kGuardPassed        (-1)
+
+/*
+ * Finish the guards once the port is set up: move r (local) to global,
+ * keep it clear of the menu bar, and classify it against the windows.
+ * Leaves the render set up for the area outside them on success.
+ */
+static short CheckPortArea(RgnHandle rgn, const Rect *r, short *overlap)
+{
+    Rect global;
+    short reject;
+
+    global = *r;
+    OffsetRect(&global, gRenderOrigin.h, gRenderOrigin.v);
+    reject = kDFRejectMenuBar;
+    if (!IsRectInMenuBar(&global)) {
+        *overlap = WindowOverlap(rgn, &global);
+        if (*overlap == kWinPartial)
+            ClipOutWindows();
+        if (*overlap != kWinAll)
+            return kGuardPassed;
+        reject = kDFRejectWindows;
+    }
+    EndPortClip();
+    return reject;
+}
+
+/*
+ * Decide whether a FillCRgn is a desktop redraw we should fix: drawn
+ * through WMgrCPort, 1-250px each way (any size on the full-desktop
+ * path), clear of the menu bar, and not entirely under the windows.
+ * On success the port clips are set for the render and *overlap says
+ * whether any of it is under a window.
+ */
+static short ShouldFixRgn(RgnHandle rgn, short *overlap)
+{
+    Rect bbox;
+
+    if (!rgn || !*rgn)
+        return kDFRejectSize;
+
+    bbox = (**rgn).rgnBBox;
+
+    if (!IsFixSize(&bbox, gMaxFixRgnSize))
+        return kDFRejectSize;
+    if (!(gPolicy & kPolicyAnyFillPort) && !IsWMgrDraw())
+        return kDFRejectPort;
+    if (!EnsureScreenInfo())
+        return kDFRejectScreens;
+    if (!BeginPortClip())
+        return kDFRejectOffscreen;
+
+    return CheckPortArea(rgn, &bbox, overlap);
 }
 
 /*
@@ -347,40 +1299,69 @@ static Boolean IsRectInAnyWindowStruc(const Rect *r)
  * the framebuffer. This completely bypasses QuickDraw's broken
  * 32bpp pattern rendering.
  *
- * Only fires for small regions drawn through WMgrCPort that
- * don't overlap any window's structure region.
+ * Only fires for small regions drawn through WMgrCPort that aren't
+ * entirely under the windows, and only paints the port's visRgn and
+ * clipRgn outside them. In head patch mode the guards run first and
+ * the original is skipped for fills clear of every window; with
+ * kOptBatch those are queued rather than painted. Fills that reach
+ * under a window always let QuickDraw draw first.
  */
 pascal void PatchedFillCRgn(RgnHandle rgn, PixPatHandle pp)
 {
-    Rect bbox;
-
-    if (gInPatch) {
+    DFTrapStats *st = &gStats.traps[kDFTrapFillCRgn];
+    UnsignedWide start;
+    UnsignedWide callStart;
+    Boolean fix;
+    short overlap, reject;
+
+    if (!EnterPatch()) {
+        gStats.rejects[kDFTrapFillCRgn][kDFRejectNested]++;
         gOldFillCRgn(rgn, pp);
+        LeavePatch();
         return;
     }
 
-    gInPatch = 1;
-
-    /* Call the original FillCRgn */
-    gOldFillCRgn(rgn, pp);
-
-    /* Only fix small desktop regions drawn through WMgrCPort */
-    if (EnsureScreenInfo() && rgn && *rgn && IsWMgrDraw()) {
-        bbox = (**rgn).rgnBBox;
+    st->calls++;
+    if (gTrace)
+        Microseconds(&callStart);
+
+    reject = ShouldFixRgn(rgn, &overlap);
+    fix = reject == kGuardPassed;
+    if (fix)
+        st->fixed++;
+    else
+        gStats.rejects[kDFTrapFillCRgn][reject]++;
+
+    if (fix && (gOptions & kOptHeadPatch) && overlap == kWinNone &&
+        IsRectOnDirectScreens(&(**rgn).rgnBBox)) {
+        /* We paint it; QuickDraw only gets it if we can't */
+        if ((gOptions & kOptBatch) && QueueFill(rgn, pp)) {
+            /* painted at the next flush */
+        } else {
+            FlushPending();
+            if (!StatRenderRgn(st, rgn, pp))
+                gOldFillCRgn(rgn, pp);
+        }
+    } else if (fix) {
+        FlushPending();
 
-        if ((bbox.right - bbox.left) >= 1 &&
-            (bbox.bottom - bbox.top) >= 1 &&
-            (bbox.right - bbox.left) <= 250 &&
-            (bbox.bottom - bbox.top) <= 250 &&
-            bbox.top >= LM_MBarHeight &&
-            !IsRectInAnyWindowStruc(&bbox)) {
+        /* Call the original FillCRgn */
+        Microseconds(&start);
+        gOldFillCRgn(rgn, pp);
+        StatsAddMicros(&st->trapMicros, &start);
 
-            /* Re-render the pattern correctly at 32bpp */
-            RenderPatternInRgn(rgn, pp);
-        }
+        /* Re-render the pattern correctly at 32bpp */
+        StatRenderRgn(st, rgn, pp);
+    } else {
+        FlushPending();
+        gOldFillCRgn(rgn, pp);
     }
 
-    gInPatch = 0;
+    EndPortClip();
+    if (gTrace)
+        TraceCall(kDFTrapFillCRgn, NULL, rgn, fix, &callStart);
+    NoteCacheUsage();
+    LeavePatch();
 }
 
 /*
@@ -392,7 +1373,7 @@ static PixPatHandle GetCurrentBkPixPat(void)
     GrafPtr port;
     CGrafPtr cport;
 
-    GetPort(&port);
+    port = CurrentPort();
     if (!port)
         return NULL;
 
@@ -405,40 +1386,509 @@ static PixPatHandle GetCurrentBkPixPat(void)
     return NULL;
 }
 
+/*
+ * First half of the EraseRect/EraseRgn guards: at least 1px and at
+ * most cap each way (any size on the full-desktop path) - the rect cap
+ * for EraseRect, the region cap for EraseRgn - and a color port with
+ * a bkPixPat to erase with, which is returned in *bkPat. These touch
+ * nothing shared, so they are safe to run before EnterPatch, and
+ * between them they turn away almost every erase - text, buttons,
+ * list cells - that isn't ours.
+ */
+static short QuickCheckErase(const Rect *r, short cap, PixPatHandle *bkPat)
+{
+    if (!r || !IsFixSize(r, cap))
+        return kDFRejectSize;
+    *bkPat = GetCurrentBkPixPat();
+    if (!*bkPat)
+        return kDFRejectPort;
+    return kGuardPassed;
+}
+
+/*
+ * Rest of them, once QuickCheckErase has passed: on a screen we render,
+ * clear of the menu bar and not entirely under the windows. r is the
+ * rect or the region's bbox; rgn is NULL for EraseRect. On success the
+ * port clips are set, as for ShouldFixRgn.
+ */
+static short ShouldFixErase(const Rect *r, RgnHandle rgn, short *overlap)
+{
+    if (!EnsureScreenInfo())
+        return kDFRejectScreens;
+    if (!BeginPortClip())
+        return kDFRejectOffscreen;
+
+    return CheckPortArea(rgn, r, overlap);
+}
+
+/*
+ * Count an EraseRect that QuickCheckErase turned away, on its way to
+ * the original: as nested inside another patched call, or as a
+ * top-level call with the guard that rejected it. Nothing is flushed
+ * here; if a batch is pending, the drawing barrier on StdRect paints
+ * it before the original draws.
+ */
+static void TurnAwayErase(short reject)
+{
+    if (gPatchDepth) {
+        gStats.rejects[kDFTrapEraseRect][kDFRejectNested]++;
+    } else {
+        gStats.traps[kDFTrapEraseRect].calls++;
+        gStats.rejects[kDFTrapEraseRect][reject]++;
+    }
+}
+
 /*
  * Patched EraseRect - v14
  *
  * After EraseRect runs, re-render the current port's background PixPat
  * directly to the framebuffer. Fixes text rename and border corruption
- * at 32bpp. Works for any color port, not just WMgrCPort.
+ * at 32bpp. Works for any color port, not just WMgrCPort. In head patch
+ * mode the original is skipped for the erases we repaint.
+ *
+ * Menus, title bars and every dialog erase through here, so the calls
+ * QuickCheckErase turns away go straight to the original: a size test,
+ * two port reads, the nesting test and two counters, with no trap
+ * calls. MeasureRejectPath times it at startup. With kOptTrace they
+ * take the long way, so they are still recorded.
  */
 pascal void PatchedEraseRect(const Rect *r)
 {
+    DFTrapStats *st = &gStats.traps[kDFTrapEraseRect];
+    UnsignedWide start;
+    UnsignedWide callStart;
     PixPatHandle bkPat;
+    short overlap, reject;
+
+    reject = QuickCheckErase(r, gMaxFixRectSize, &bkPat);
+    if (reject != kGuardPassed && !gTrace) {
+        TurnAwayErase(reject);
+        gOldEraseRect(r);
+        return;
+    }
 
-    if (gInPatch) {
+    if (!EnterPatch()) {
+        gStats.rejects[kDFTrapEraseRect][kDFRejectNested]++;
         gOldEraseRect(r);
+        LeavePatch();
         return;
     }
 
-    gInPatch = 1;
-    gOldEraseRect(r);
+    st->calls++;
+    if (gTrace)
+        Microseconds(&callStart);
+    FlushPending();
+
+    if (reject == kGuardPassed)
+        reject = ShouldFixErase(r, NULL, &overlap);
+    if (reject == kGuardPassed) {
+        st->fixed++;
+    } else {
+        gStats.rejects[kDFTrapEraseRect][reject]++;
+        bkPat = NULL;
+    }
+
+    if (bkPat && (gOptions & kOptHeadPatch) && overlap == kWinNone &&
+        IsRectOnDirectScreens(r)) {
+        if (!StatRenderRect(st, r, bkPat))
+            gOldEraseRect(r);
+    } else if (bkPat) {
+        Microseconds(&start);
+        gOldEraseRect(r);
+        StatsAddMicros(&st->trapMicros, &start);
+
+        StatRenderRect(st, r, bkPat);
+    } else {
+        gOldEraseRect(r);
+    }
+
+    EndPortClip();
+    if (gTrace)
+        TraceCall(kDFTrapEraseRect, r, NULL, bkPat != NULL, &callStart);
+    NoteCacheUsage();
+    LeavePatch();
+}
+
+/*
+ * Patched EraseRgn
+ *
+ * Same as PatchedEraseRect, for the desktop utilities and Finder paths
+ * that erase regions. Uses the current port's bkPixPat and goes through
+ * the same span renderer and tile cache as FillCRgn.
+ */
+pascal void PatchedEraseRgn(RgnHandle rgn)
+{
+    DFTrapStats *st = &gStats.traps[kDFTrapEraseRgn];
+    UnsignedWide start;
+    PixPatHandle bkPat;
+    UnsignedWide callStart;
+    Rect bbox;
+    short overlap, reject;
+
+    if (!EnterPatch()) {
+        gStats.rejects[kDFTrapEraseRgn][kDFRejectNested]++;
+        gOldEraseRgn(rgn);
+        LeavePatch();
+        return;
+    }
+
+    st->calls++;
+    if (gTrace)
+        Microseconds(&callStart);
+    FlushPending();
+
+    bkPat = NULL;
+    reject = kDFRejectSize;
+    if (rgn && *rgn) {
+        bbox = (**rgn).rgnBBox;
+        reject = QuickCheckErase(&bbox, gMaxFixRgnSize, &bkPat);
+        if (reject == kGuardPassed)
+            reject = ShouldFixErase(&bbox, rgn, &overlap);
+    }
+    if (reject == kGuardPassed) {
+        st->fixed++;
+    } else {
+        gStats.rejects[kDFTrapEraseRgn][reject]++;
+        bkPat = NULL;
+    }
+
+    if (bkPat && (gOptions & kOptHeadPatch) && overlap == kWinNone &&
+        IsRectOnDirectScreens(&bbox)) {
+        if (!StatRenderRgn(st, rgn, bkPat))
+            gOldEraseRgn(rgn);
+    } else if (bkPat) {
+        Microseconds(&start);
+        gOldEraseRgn(rgn);
+        StatsAddMicros(&st->trapMicros, &start);
+
+        StatRenderRgn(st, rgn, bkPat);
+    } else {
+        gOldEraseRgn(rgn);
+    }
 
-    if (EnsureScreenInfo() && r &&
-        (r->right - r->left) >= 1 &&
-        (r->bottom - r->top) >= 1 &&
-        (r->right - r->left) <= 300 &&
-        (r->bottom - r->top) <= 300 &&
-        r->top >= LM_MBarHeight &&
-        !IsRectInAnyWindowStruc(r)) {
+    EndPortClip();
+    if (gTrace)
+        TraceCall(kDFTrapEraseRgn, NULL, rgn, bkPat != NULL, &callStart);
+    NoteCacheUsage();
+    LeavePatch();
+}
 
-        bkPat = GetCurrentBkPixPat();
-        if (bkPat) {
-            RenderPatternInRect(r, bkPat);
+/*
+ * Startup calibration (kOptCalibrate)
+ *
+ * Which blitter is fastest depends on the video card as much as on the
+ * CPU, so rather than guess we time the candidates. First RAM to RAM,
+ * which picks gSpanCopy (it fills the tile and the staging buffer);
+ * then, on a strip across the middle of every rendered screen, direct
+ * writes with each copy against staged ones; and last, on the widest
+ * screen, long runs against short ones, which is all the backing store
+ * changes. The strip is written back with what was already on it, so
+ * nothing shows.
+ *
+ * Each trial repeats for kCalTrialMicros; once the whole calibration
+ * has run for kCalBudgetMicros, whatever is left keeps its default.
+ */
+#define kCalRows            8       /* strip height */
+#define kCalLongs           512     /* strip width, at most, in longwords */
+#define kCalShortRun        32      /* run length without the backing store */
+#define kCalTrialMicros     1500UL
+#define kCalBudgetMicros    40000UL
+#define kCalStride          (kCalLongs * 4L + 16)
+
+static UInt32 *gCalSaved = NULL;    /* strip contents, kCalRows of kCalStride */
+static UInt32 *gCalScratch;         /* RAM destination, same layout */
+static UInt32 *gCalStage;           /* one row, for staged trials */
+static UnsignedWide gCalStart;
+
+static void PurgeCalibration(Ptr block)
+{
+    ArenaFree(block);
+    gCalSaved = NULL;
+}
+
+static unsigned long ElapsedMicros(const UnsignedWide *start)
+{
+    UnsignedWide now;
+
+    Microseconds(&now);
+    return now.lo - start->lo;
+}
+
+static Boolean CalOverBudget(void)
+{
+    return ElapsedMicros(&gCalStart) >= kCalBudgetMicros;
+}
+
+/*
+ * Saved copy of the strip row that dst is, at the same offset within
+ * a 16-byte line so MOVE16 can run on it as it does on the tile.
+ */
+static UInt32 *CalSource(short row, const UInt32 *dst)
+{
+    return (UInt32 *)((Ptr)gCalSaved + row * kCalStride +
+                      ((unsigned long)dst & 15));
+}
+
+/*
+ * Copy the saved strip over kCalRows rows at dst, longs wide, in runs
+ * of run longwords - assembled in gCalStage and moved with one
+ * BlockMoveData per row if staged - until kCalTrialMicros have passed.
+ * Returns the time per pass in 1/16 microseconds.
+ */
+static unsigned long CalTrial(Ptr dst, long rowBytes, short longs, short run,
+                              SpanCopyProc copy, Boolean staged)
+{
+    UnsignedWide start;
+    unsigned long passes, elapsed;
+    UInt32 *rowPtr, *out;
+    const UInt32 *src;
+    short row, x, n;
+
+    passes = 0;
+    Microseconds(&start);
+    do {
+        for (row = 0; row < kCalRows; row++) {
+            rowPtr = (UInt32 *)(dst + row * rowBytes);
+            out = staged ? gCalStage : rowPtr;
+            src = CalSource(row, rowPtr);
+            for (x = 0; x < longs; x += n) {
+                n = longs - x < run ? longs - x : run;
+                copy(out + x, src + x, n);
+            }
+            if (staged)
+                BlockMoveData(gCalStage, rowPtr, longs * 4L);
+        }
+        passes++;
+        elapsed = ElapsedMicros(&start);
+    } while (elapsed < kCalTrialMicros);
+    return (elapsed << 4) / passes;
+}
+
+/* Strip in the middle of a screen and its width in longwords, or 0 */
+static short CalStrip(const ScreenInfo *scr, Ptr *strip)
+{
+    long bytes;
+    short height;
+
+    height = scr->bounds.bottom - scr->bounds.top;
+    bytes = (long)(scr->bounds.right - scr->bounds.left) * scr->pixelSize / 8;
+    if (height < kCalRows || bytes < kCalShortRun * 4L)
+        return 0;
+
+    *strip = scr->baseAddr + (long)((height - kCalRows) / 2) * scr->rowBytes;
+    return bytes / 4 < kCalLongs ? bytes / 4 : kCalLongs;
+}
+
+static void Calibrate(void)
+{
+    SpanCopyProc procs[3], backCopy;
+    unsigned long t, best, backBest;
+    short procCount, i, p, row, longs, backLongs;
+    long backRowBytes;
+    Ptr block, strip, backStrip;
+    Boolean backStaged, dropBacking;
+    ScreenInfo *scr;
+    CalResult *res;
+#if defined(__m68k__)
+    long cpu;
+#endif
+
+    procs[0] = SpanCopyC;
+    procCount = 1;
+#if defined(__m68k__)
+    if (Gestalt(gestaltProcessorType, &cpu) == noErr) {
+        if (cpu >= gestalt68020)
+            procs[procCount++] = SpanCopy020;
+        if (cpu >= gestalt68040)
+            procs[procCount++] = SpanCopy040;
+    }
+#endif
+
+    block = ArenaAlloc(2 * kCalRows * kCalStride + kCalLongs * 4L, PurgeCalibration);
+    if (!block)
+        return;
+    gCalSaved = (UInt32 *)block;
+    gCalScratch = (UInt32 *)(block + kCalRows * kCalStride);
+    gCalStage = (UInt32 *)(block + 2 * kCalRows * kCalStride);
+    Microseconds(&gCalStart);
+
+    /* RAM to RAM; the contents don't matter */
+    best = 0;
+    for (p = 0; p < procCount && !CalOverBudget(); p++) {
+        t = CalTrial((Ptr)gCalScratch, kCalStride, kCalLongs, kCalShortRun,
+                     procs[p], false);
+        if (!best || t < best) {
+            best = t;
+            gSpanCopy = procs[p];
+        }
+    }
+
+    gCalCount = 0;
+    backLongs = 0;
+    backBest = 0;
+    backCopy = gSpanCopy;
+    backStaged = false;
+    backStrip = NULL;
+    backRowBytes = 0;
+    EnsureScreenInfo();
+    HideCursor();
+    for (i = 0; i < gScreenCount && !CalOverBudget(); i++) {
+        scr = &gScreens[i];
+        if (!IsRenderedDepth(scr->pixelSize))
+            continue;
+        longs = CalStrip(scr, &strip);
+        if (!longs)
+            continue;
+
+        for (row = 0; row < kCalRows; row++)
+            BlockMoveData(strip + row * scr->rowBytes,
+                          CalSource(row, (UInt32 *)(strip + row * scr->rowBytes)),
+                          longs * 4L);
+
+        res = &gCalResults[gCalCount++];
+        res->device = scr->device;
+        res->blitMode = kBlitDirect;
+        res->spanCopy = NULL;
+        best = 0;
+        for (p = 0; p < procCount && !CalOverBudget(); p++) {
+            t = CalTrial(strip, scr->rowBytes, longs, kCalShortRun, procs[p], false);
+            if (!best || t < best) {
+                best = t;
+                res->spanCopy = procs[p];
+            }
+        }
+        /* 16bpp fills never stage (see FillSpan), so there is no contest */
+        if (scr->pixelSize == 32 && !CalOverBudget()) {
+            t = CalTrial(strip, scr->rowBytes, longs, kCalShortRun, gSpanCopy, true);
+            if (t < best) {
+                best = t;
+                res->blitMode = kBlitStaged;
+                res->spanCopy = NULL;
+            }
+        }
+        if (res->spanCopy == gSpanCopy)
+            res->spanCopy = NULL;
+
+        if (longs > backLongs) {
+            backLongs = longs;
+            backBest = best;
+            backStrip = strip;
+            backRowBytes = scr->rowBytes;
+            backStaged = res->blitMode == kBlitStaged;
+            backCopy = res->spanCopy ? res->spanCopy : gSpanCopy;
         }
     }
 
-    gInPatch = 0;
+    /* Worth its memory only if long runs are at least an eighth faster */
+    dropBacking = false;
+    if (gBackingBudget > 0 && backStrip && !CalOverBudget()) {
+        t = CalTrial(backStrip, backRowBytes, backLongs, backLongs, backCopy, backStaged);
+        dropBacking = t > backBest - backBest / 8;
+    }
+    ShowCursor();
+
+    ArenaFree((Ptr)gCalSaved);
+    gCalSaved = NULL;
+    if (dropBacking) {
+        gBackingBudget = 0;
+        ArenaTrim(gBackingBytes);
+    }
+
+    /* Rebuild the table with the results on the next trap */
+    gScreensValid = 0;
+}
+
+/*
+ * Cost of the EraseRect reject path, for gStats.eraseRejectNanos.
+ *
+ * Calls PatchedEraseRect with an empty rect, which the size check
+ * turns away, over an original that returns at once, and subtracts
+ * calling that original directly. Run before the patches go in and
+ * before the trace is set up; the counters the calls bump are put
+ * back afterwards. Best of kRejectRounds, since a VBL task can land in
+ * any of them.
+ */
+#define kRejectCalls        1000
+#define kRejectRounds       3
+
+static pascal void NullEraseRect(const Rect *r)
+{
+    (void)r;
+}
+
+static void MeasureRejectPath(void)
+{
+    EraseRectProcPtr volatile patched = PatchedEraseRect;
+    EraseRectProcPtr volatile bare = NullEraseRect;
+    DFTrapStats saved;
+    unsigned long savedRejects[kDFRejectCount];
+    unsigned long withPatch, without, best;
+    UnsignedWide start;
+    Rect empty;
+    short round, i;
+
+    saved = gStats.traps[kDFTrapEraseRect];
+    BlockMoveData(gStats.rejects[kDFTrapEraseRect], savedRejects,
+                  sizeof(savedRejects));
+    gOldEraseRect = NullEraseRect;
+    SetRect(&empty, 0, 0, 0, 0);
+
+    best = 0;
+    for (round = 0; round < kRejectRounds; round++) {
+        Microseconds(&start);
+        for (i = 0; i < kRejectCalls; i++)
+            patched(&empty);
+        withPatch = ElapsedMicros(&start);
+
+        Microseconds(&start);
+        for (i = 0; i < kRejectCalls; i++)
+            bare(&empty);
+        without = ElapsedMicros(&start);
+
+        withPatch = withPatch > without ? withPatch - without : 0;
+        if (round == 0 || withPatch < best)
+            best = withPatch;
+    }
+
+    gOldEraseRect = NULL;
+    gStats.traps[kDFTrapEraseRect] = saved;
+    BlockMoveData(savedRejects, gStats.rejects[kDFTrapEraseRect],
+                  sizeof(savedRejects));
+    gStats.eraseRejectNanos = best * 1000UL / kRejectCalls;
+}
+
+/*
+ * Apply the 'DsFx' tuning resource, if there is a usable one.
+ */
+static void ReadPrefs(void)
+{
+    Handle h;
+    DesktopFixPrefs *prefs;
+
+    h = Get1Resource(kPrefsType, kPrefsID);
+    if (!h)
+        return;
+
+    prefs = (DesktopFixPrefs *)*h;
+    if ((prefs->version == 1 && GetHandleSize(h) >= kPrefsV1Size) ||
+        (prefs->version == kPrefsVersion &&
+         GetHandleSize(h) >= (long)sizeof(DesktopFixPrefs))) {
+        gOptions = prefs->options;
+        gTraps = prefs->traps & kAllTraps;
+        gPolicy = prefs->policy;
+        if (prefs->maxRgnSize > 0)
+            gMaxFixRgnSize = prefs->maxRgnSize;
+        if (prefs->maxRectSize > 0)
+            gMaxFixRectSize = prefs->maxRectSize;
+        if (prefs->backingBudget > 0)
+            gBackingBytes = prefs->backingBudget;
+        if (prefs->spanCacheSize >= 0)
+            gSpanCacheSize = prefs->spanCacheSize < kSpanCacheEntries ?
+                             prefs->spanCacheSize : kSpanCacheEntries;
+        if (prefs->version >= 2 && prefs->cacheBudget > 0)
+            gCacheBytes = prefs->cacheBudget;
+    }
+    ReleaseResource(h);
 }
 
 /*
@@ -447,7 +1897,11 @@ pascal void PatchedEraseRect(const Rect *r)
 void _start(void)
 {
     long qdVersion;
+#if defined(__m68k__)
+    long cpu;
+#endif
     Handle self;
+    THz savedZone;
 
     RETRO68_RELOCATE();
     Retro68CallConstructors();
@@ -460,11 +1914,133 @@ void _start(void)
     if (qdVersion < gestalt32BitQD)
         goto bail;
 
-    gOldFillCRgn = (FillCRgnProcPtr)GetToolTrapAddress(kFillCRgnTrap);
-    SetToolTrapAddress((ProcPtr)PatchedFillCRgn, kFillCRgnTrap);
+    ReadPrefs();
+    if (!gTraps)
+        goto bail;
+
+    if (gOptions & kOptBackingStore)
+        gBackingBudget = gBackingBytes;
+
+    /*
+     * Reserve every cache's memory now, so the patches never allocate.
+     * Without it nothing can be cached, and every call goes to QuickDraw.
+     */
+    if (!ArenaInit(gCacheBytes + gBackingBudget))
+        goto bail;
+    if (gArenaSize < gCacheBytes + gBackingBudget)
+        gBackingBudget = 0;
+    if ((gOptions & (kOptHeadPatch | kOpt16Bit)) == (kOptHeadPatch | kOpt16Bit))
+        gRender16 = true;
+
+    /* Pick the span blitter for this CPU once */
+#if defined(__m68k__)
+    if (Gestalt(gestaltProcessorType, &cpu) == noErr) {
+        if (cpu >= gestalt68040)
+            gSpanCopy = SpanCopy040;
+        else if (cpu >= gestalt68020)
+            gSpanCopy = SpanCopy020;
+    }
+#endif
+
+    /* Time them instead, now that the screens are up and nothing else draws */
+    if (gOptions & kOptCalibrate)
+        Calibrate();
+    MeasureRejectPath();
+    NoteCacheUsage();
+
+    if (gTraps & (1 << kDFTrapFillCRgn)) {
+        gOldFillCRgn = (FillCRgnProcPtr)GetToolTrapAddress(kFillCRgnTrap);
+        SetToolTrapAddress((ProcPtr)PatchedFillCRgn, kFillCRgnTrap);
+    }
+
+    if (gTraps & (1 << kDFTrapEraseRect)) {
+        gOldEraseRect = (EraseRectProcPtr)GetToolTrapAddress(kEraseRectTrap);
+        SetToolTrapAddress((ProcPtr)PatchedEraseRect, kEraseRectTrap);
+    }
+
+    if (gTraps & (1 << kDFTrapEraseRgn)) {
+        gOldEraseRgn = (EraseRgnProcPtr)GetToolTrapAddress(kEraseRgnTrap);
+        SetToolTrapAddress((ProcPtr)PatchedEraseRgn, kEraseRgnTrap);
+    }
+
+    gOldInitGDevice = (InitGDeviceProcPtr)GetToolTrapAddress(kInitGDeviceTrap);
+    SetToolTrapAddress((ProcPtr)PatchedInitGDevice, kInitGDeviceTrap);
+
+    /* Window union lives in the system heap; without it we walk the list */
+    savedZone = GetZone();
+    SetZone(SystemZone());
+    gWinRgn = NewRgn();
+    gScratchRgn = NewRgn();
+    if ((gOptions & (kOptHeadPatch | kOptBatch)) == (kOptHeadPatch | kOptBatch) &&
+        (gTraps & (1 << kDFTrapFillCRgn)))
+        gPendingRgn = NewRgn();
+    SetZone(savedZone);
+
+    gOldCalcVisBehind = (WindowRgnProcPtr)GetToolTrapAddress(kCalcVisBehindTrap);
+    SetToolTrapAddress((ProcPtr)PatchedCalcVisBehind, kCalcVisBehindTrap);
+
+    gOldPaintBehind = (WindowRgnProcPtr)GetToolTrapAddress(kPaintBehindTrap);
+    SetToolTrapAddress((ProcPtr)PatchedPaintBehind, kPaintBehindTrap);
+
+    /* Flush points and drawing barriers, only needed when batching */
+    if (gPendingRgn) {
+        gOldEndUpdate = (EndUpdateProcPtr)GetToolTrapAddress(kEndUpdateTrap);
+        SetToolTrapAddress((ProcPtr)PatchedEndUpdate, kEndUpdateTrap);
+        gOldGetNextEvent = (GetNextEventProcPtr)GetToolTrapAddress(kGetNextEventTrap);
+        SetToolTrapAddress((ProcPtr)PatchedGetNextEvent, kGetNextEventTrap);
+        gOldWaitNextEvent = (WaitNextEventProcPtr)GetToolTrapAddress(kWaitNextEventTrap);
+        SetToolTrapAddress((ProcPtr)PatchedWaitNextEvent, kWaitNextEventTrap);
+
+        gOldStdText = (StdTextProcPtr)GetToolTrapAddress(kStdTextTrap);
+        SetToolTrapAddress((ProcPtr)BarrierStdText, kStdTextTrap);
+        gOldStdLine = (StdLineProcPtr)GetToolTrapAddress(kStdLineTrap);
+        SetToolTrapAddress((ProcPtr)BarrierStdLine, kStdLineTrap);
+        gOldStdRect = (StdRectProcPtr)GetToolTrapAddress(kStdRectTrap);
+        SetToolTrapAddress((ProcPtr)BarrierStdRect, kStdRectTrap);
+        gOldStdRRect = (StdRRectProcPtr)GetToolTrapAddress(kStdRRectTrap);
+        SetToolTrapAddress((ProcPtr)BarrierStdRRect, kStdRRectTrap);
+        gOldStdOval = (StdOvalProcPtr)GetToolTrapAddress(kStdOvalTrap);
+        SetToolTrapAddress((ProcPtr)BarrierStdOval, kStdOvalTrap);
+        gOldStdArc = (StdArcProcPtr)GetToolTrapAddress(kStdArcTrap);
+        SetToolTrapAddress((ProcPtr)BarrierStdArc, kStdArcTrap);
+        gOldStdPoly = (StdPolyProcPtr)GetToolTrapAddress(kStdPolyTrap);
+        SetToolTrapAddress((ProcPtr)BarrierStdPoly, kStdPolyTrap);
+        gOldStdRgn = (StdRgnProcPtr)GetToolTrapAddress(kStdRgnTrap);
+        SetToolTrapAddress((ProcPtr)BarrierStdRgn, kStdRgnTrap);
+        gOldStdBits = (StdBitsProcPtr)GetToolTrapAddress(kStdBitsTrap);
+        SetToolTrapAddress((ProcPtr)BarrierStdBits, kStdBitsTrap);
+        gOldCopyMask = (CopyMaskProcPtr)GetToolTrapAddress(kCopyMaskTrap);
+        SetToolTrapAddress((ProcPtr)BarrierCopyMask, kCopyMaskTrap);
+        gOldCopyDeepMask = (CopyDeepMaskProcPtr)GetToolTrapAddress(kCopyDeepMaskTrap);
+        SetToolTrapAddress((ProcPtr)BarrierCopyDeepMask, kCopyDeepMaskTrap);
+
+        if (gOptions & kOptVBLFlush)
+            InstallVBLFlush();
+    }
 
-    gOldEraseRect = (EraseRectProcPtr)GetToolTrapAddress(kEraseRectTrap);
-    SetToolTrapAddress((ProcPtr)PatchedEraseRect, kEraseRectTrap);
+    /* Give cache memory back when the system heap runs dry */
+    gOldSysGrowZone = SystemZone()->gzProc;
+    SystemZone()->gzProc = (GrowZoneUPP)DesktopFixGrowZone;
+
+    /* Publish the counters; failure just means no monitor can read them */
+    gStats.version = kDesktopFixStatsVersion;
+    gStats.structSize = sizeof(DesktopFixStats);
+    NewGestalt(kDesktopFixGestalt, (SelectorFunctionUPP)DesktopFixGestalt);
+
+    if (gOptions & kOptTrace) {
+        gTrace = (DesktopFixTrace *)NewPtrSysClear(sizeof(DesktopFixTrace));
+        if (gTrace) {
+            gTrace->version = kDesktopFixTraceVersion;
+            gTrace->entrySize = sizeof(DFTraceEntry);
+            gTrace->structSize = sizeof(DesktopFixTrace);
+            gTrace->entryCount = kDFTraceEntries;
+            if (NewGestalt(kDesktopFixTraceGestalt,
+                           (SelectorFunctionUPP)DesktopFixTraceGestalt) != noErr) {
+                DisposePtr((Ptr)gTrace);
+                gTrace = NULL;
+            }
+        }
+    }
 
     self = Get1Resource('INIT', 128);
     if (self) {
@@ -38,3 +38,30 @@ resource 'ICN#' (128) {
 		$"00003FC000001F800000000000000000";
 	}
 };
+
+/*
+ * Tuning, read once at startup - see DesktopFixPrefs in desktopfix.c.
+ * These are the compiled-in defaults; edit them per machine.
+ */
+type 'DsFx' {
+	integer = 2;				/* version */
+	unsigned hex longint;		/* options: kOpt* bits */
+	unsigned hex integer;		/* traps: FillCRgn $1, EraseRect $2, EraseRgn $4 */
+	unsigned hex integer;		/* policy: kPolicyAnyFillPort $1 */
+	integer;					/* FillCRgn/EraseRgn size cap, pixels */
+	integer;					/* EraseRect size cap, pixels */
+	longint;					/* backing store budget, bytes */
+	integer;					/* decoded regions cached, 0-4 */
+	longint;					/* cache budget, bytes */
+};
+
+resource 'DsFx' (128, purgeable) {
+	$00000000,
+	$0007,
+	$0000,
+	250,
+	300,
+	524288,
+	4,
+	262144
+};
@@ -0,0 +1,1559 @@
+/*
+ * DesktopFix pattern rendering core - see render.h
+ */
+
+#include <Quickdraw.h>
+#include <Memory.h>
+#include "render.h"
+#include "arena.h"
+
+ScreenInfo gScreens[kMaxScreens];
+short gScreenCount = 0;
+unsigned long gPixelsWritten = 0;
+
+/*
+ * Clip a rect to a screen's bounds. Returns false if nothing is left.
+ */
+Boolean ClipToScreen(const Rect *r, const ScreenInfo *scr, Rect *out)
+{
+    out->left = r->left > scr->bounds.left ? r->left : scr->bounds.left;
+    out->top = r->top > scr->bounds.top ? r->top : scr->bounds.top;
+    out->right = r->right < scr->bounds.right ? r->right : scr->bounds.right;
+    out->bottom = r->bottom < scr->bounds.bottom ? r->bottom : scr->bounds.bottom;
+    return out->left < out->right && out->top < out->bottom;
+}
+
+Boolean gRender16 = false;
+
+/*
+ * Whether screens of this depth are drawn by the render core.
+ */
+Boolean IsRenderedDepth(short pixelSize)
+{
+    return pixelSize == 32 || (pixelSize == 16 && gRender16);
+}
+
+/*
+ * Address of global pixel (0, y) on a 32bpp or 16bpp screen, so the
+ * row can be indexed directly with global x coordinates.
+ */
+static Ptr ScreenRow(const ScreenInfo *scr, short y)
+{
+    return scr->baseAddr + (long)(y - scr->bounds.top) * scr->rowBytes -
+           (long)scr->bounds.left * (scr->pixelSize >> 3);
+}
+
+/*
+ * Region span decoding.
+ *
+ * After rgnSize/rgnBBox, a non-rectangular region holds a list of
+ * scanline records: a y coordinate, then ascending x inversion points,
+ * then 0x7FFF. The list ends with a lone 0x7FFF. Every inversion point
+ * flips the inside/outside state of all pixels at or right of it, from
+ * its scanline down. XOR-merging each record into a running edge list
+ * therefore gives, for any row, the spans [e0,e1) [e2,e3) ... - exactly
+ * the pixels PtInRgn accepts on that row.
+ */
+#define kRgnHeaderSize  10      /* rgnSize + rgnBBox */
+#define kMaxRgnEdges    256
+#define kRgnEnd         0x7FFF
+
+typedef struct {
+    const short *data;      /* next scanline record */
+    const short *dataEnd;   /* end of region data, from rgnSize */
+    short nextV;            /* y of next record, kRgnEnd when done */
+    short count;            /* number of edges on the current row */
+    short edges[kMaxRgnEdges];
+} RgnSpanState;
+
+static RgnSpanState gRgnSpans;
+static short gRgnMerge[kMaxRgnEdges];
+
+/*
+ * Start decoding a region. Rectangular regions (rgnSize == 10) have no
+ * data and are treated as a single span over the bbox rows.
+ */
+static void RgnSpansBegin(RgnHandle rgn, RgnSpanState *s)
+{
+    RgnPtr r = *rgn;
+
+    s->count = 0;
+    if (r->rgnSize <= kRgnHeaderSize) {
+        s->data = NULL;
+        s->dataEnd = NULL;
+        s->nextV = r->rgnBBox.top;
+    } else {
+        s->data = (const short *)((Ptr)r + kRgnHeaderSize);
+        s->dataEnd = (const short *)((Ptr)r + r->rgnSize);
+        s->nextV = *s->data;
+    }
+}
+
+/*
+ * Apply every scanline record at or above row y to the edge list.
+ * Returns false if the region is malformed or has more edges on a row
+ * than we can track; the caller then falls back to PtInRgn.
+ */
+static Boolean RgnSpansAdvance(RgnSpanState *s, RgnHandle rgn, short y)
+{
+    const short *p;
+    short i, j, n, a, b;
+
+    while (s->nextV <= y && s->nextV != kRgnEnd) {
+        if (!s->data) {
+            /* Rectangular region: one span over the bbox rows */
+            if (s->count == 0 && y < (**rgn).rgnBBox.bottom) {
+                s->edges[0] = (**rgn).rgnBBox.left;
+                s->edges[1] = (**rgn).rgnBBox.right;
+                s->count = 2;
+                s->nextV = (**rgn).rgnBBox.bottom;
+            } else {
+                s->count = 0;
+                s->nextV = kRgnEnd;
+            }
+            continue;
+        }
+
+        /* Merge this record's points into the edge list (sorted XOR) */
+        p = s->data + 1;
+        i = j = n = 0;
+        for (;;) {
+            if (p >= s->dataEnd)
+                return false;
+            b = *p;
+            a = (i < s->count) ? s->edges[i] : kRgnEnd;
+            if (a == kRgnEnd && b == kRgnEnd)
+                break;
+            if (n >= kMaxRgnEdges)
+                return false;
+            if (a < b) {
+                gRgnMerge[n++] = a;
+                i++;
+            } else if (b < a) {
+                gRgnMerge[n++] = b;
+                p++;
+            } else {
+                /* Same point in both: the inversions cancel */
+                i++;
+                p++;
+            }
+        }
+
+        for (j = 0; j < n; j++)
+            s->edges[j] = gRgnMerge[j];
+        s->count = n;
+
+        s->data = p + 1;
+        if (s->data >= s->dataEnd)
+            return false;
+        s->nextV = *s->data;
+    }
+    return true;
+}
+
+/*
+ * Decoded span cache.
+ *
+ * Icon highlights and label redraws fill the same few region shapes
+ * over and over. The last few non-rectangular regions are kept
+ * decoded as a list of bands: a y, an edge count n and n edges, each
+ * band covering the rows down to the next band's y. The list ends
+ * with a y of kRgnEnd. A repeat fill then replays the bands instead
+ * of merging inversion points again.
+ *
+ * Entries are keyed on the handle, rgnSize, rgnBBox and a rotating
+ * sum of the region data, so a handle reused for another shape of the
+ * same size and bbox still misses. A region is only decoded into the
+ * cache the second time it is seen, so one-off fills cost a checksum
+ * and nothing more. Regions that decode to more than kSpanCacheShorts
+ * are remembered as uncacheable and keep the streaming decoder.
+ */
+#define kSpanCacheShorts    2048
+
+enum {
+    kSpanSeen = 0,          /* key recorded, not decoded yet */
+    kSpanDecoded,           /* bands are valid */
+    kSpanUncacheable        /* too big or too complex, don't retry */
+};
+
+typedef struct {
+    RgnHandle rgn;          /* NULL when the entry is free */
+    short rgnSize;
+    Rect bbox;
+    unsigned long sum;
+    unsigned long lastUse;
+    short state;
+    short *bands;           /* kSpanCacheShorts from the arena, on first decode */
+} SpanCacheEntry;
+
+short gSpanCacheSize = kSpanCacheEntries;
+static SpanCacheEntry gSpanCache[kSpanCacheEntries];
+static unsigned long gSpanClock = 0;
+
+/* Arena purge proc for an entry's bands: forget the entry */
+static void PurgeRgnBands(Ptr block)
+{
+    short i;
+
+    for (i = 0; i < kSpanCacheEntries; i++) {
+        if ((Ptr)gSpanCache[i].bands == block) {
+            gSpanCache[i].bands = NULL;
+            gSpanCache[i].rgn = NULL;
+        }
+    }
+    ArenaFree(block);
+}
+
+static unsigned long RgnChecksum(RgnPtr r)
+{
+    const unsigned short *p = (const unsigned short *)((Ptr)r + kRgnHeaderSize);
+    const unsigned short *end = (const unsigned short *)((Ptr)r + r->rgnSize);
+    unsigned long sum = 0;
+
+    while (p < end)
+        sum = ((sum << 5) | (sum >> 27)) + *p++;
+    return sum;
+}
+
+/*
+ * Decode every record of rgn into bands, at most shorts long. Returns
+ * false if the region is malformed, too complex for the decoder or
+ * too big for the buffer.
+ */
+static Boolean DecodeRgnBands(RgnHandle rgn, short *bands, long shorts)
+{
+    short *out = bands;
+    short *end = bands + shorts - 1;    /* room for kRgnEnd */
+    short y, i;
+
+    RgnSpansBegin(rgn, &gRgnSpans);
+    while (gRgnSpans.nextV != kRgnEnd) {
+        y = gRgnSpans.nextV;
+        if (!RgnSpansAdvance(&gRgnSpans, rgn, y))
+            return false;
+        if (end - out < 2 + gRgnSpans.count)
+            return false;
+        *out++ = y;
+        *out++ = gRgnSpans.count;
+        for (i = 0; i < gRgnSpans.count; i++)
+            *out++ = gRgnSpans.edges[i];
+    }
+    *out = kRgnEnd;
+    return true;
+}
+
+/*
+ * Find rgn's decoded bands. Returns NULL for rectangular regions, when
+ * the cache is off, and for regions that aren't (or can't be) cached;
+ * the caller then decodes as it goes. May allocate, so *rgn must be
+ * dereferenced again afterwards.
+ */
+static const short *LookupRgnBands(RgnHandle rgn)
+{
+    SpanCacheEntry *e, *victim;
+    RgnPtr r;
+    unsigned long sum;
+    short i, entries;
+
+    if (gSpanCacheSize <= 0 || (**rgn).rgnSize <= kRgnHeaderSize)
+        return NULL;
+
+    entries = gSpanCacheSize < kSpanCacheEntries ? gSpanCacheSize : kSpanCacheEntries;
+    r = *rgn;
+    sum = RgnChecksum(r);
+    gSpanClock++;
+
+    victim = NULL;
+    for (i = 0; i < entries; i++) {
+        e = &gSpanCache[i];
+        if (e->rgn == rgn && e->rgnSize == r->rgnSize && e->sum == sum &&
+            e->bbox.top == r->rgnBBox.top && e->bbox.left == r->rgnBBox.left &&
+            e->bbox.bottom == r->rgnBBox.bottom &&
+            e->bbox.right == r->rgnBBox.right)
+            break;
+        if (!victim || !e->rgn ||
+            (victim->rgn && e->lastUse < victim->lastUse))
+            victim = e;
+    }
+
+    if (i == entries) {
+        /* First sighting: just remember it */
+        victim->rgn = rgn;
+        victim->rgnSize = r->rgnSize;
+        victim->bbox = r->rgnBBox;
+        victim->sum = sum;
+        victim->lastUse = gSpanClock;
+        victim->state = kSpanSeen;
+        return NULL;
+    }
+
+    e->lastUse = gSpanClock;
+    if (e->state == kSpanSeen) {
+        /* Seen before: worth decoding now */
+        if (!e->bands)
+            e->bands = (short *)ArenaAlloc(kSpanCacheShorts * sizeof(short),
+                                           PurgeRgnBands);
+        if (!e->bands)
+            return NULL;        /* no room now; try again next time */
+        e->state = DecodeRgnBands(rgn, e->bands, kSpanCacheShorts) ?
+                   kSpanDecoded : kSpanUncacheable;
+    }
+    if (e->state != kSpanDecoded)
+        return NULL;
+    ArenaTouch((Ptr)e->bands);
+    return e->bands;
+}
+
+/*
+ * Clip regions applied to every span before it is filled (see
+ * render.h). Each is decoded alongside the region being drawn, so
+ * clipping costs a merge of two sorted span lists per row rather than
+ * any region arithmetic.
+ */
+RenderClip gRenderClips[kMaxRenderClips];
+short gRenderClipCount = 0;
+Point gRenderOrigin;
+
+static RgnSpanState gClipSpans[kMaxRenderClips];
+static short gRowSpans[2][kMaxRgnEdges];
+static short gOriginSpans[kMaxRgnEdges];
+
+static void ClipSpansBegin(void)
+{
+    short c;
+
+    for (c = 0; c < gRenderClipCount; c++)
+        RgnSpansBegin(gRenderClips[c].rgn, &gClipSpans[c]);
+}
+
+/* Clip edge in global coordinates, clamped so wide-open rgns don't wrap */
+static short ClipEdge(short e, short dh)
+{
+    long g = (long)e + dh;
+
+    if (g < -32767) return -32767;
+    if (g > 32767) return 32767;
+    return (short)g;
+}
+
+/* A row of the fill's own spans (n edges), moved to global */
+static const short *OriginRow(const short *src, short n)
+{
+    short i;
+
+    for (i = 0; i < n; i++)
+        gOriginSpans[i] = ClipEdge(src[i], gRenderOrigin.h);
+    return gOriginSpans;
+}
+
+/*
+ * Combine the spans in a (na edges) with clip c's spans on this row,
+ * into out. Both lists are sorted and disjoint; exclude clips remove
+ * their spans instead of keeping them. Returns the new edge count, or
+ * -1 if the result has too many edges to hold.
+ */
+static short ClipSpanList(const short *a, short na, short c, short *out)
+{
+    const RenderClip *rc = &gRenderClips[c];
+    const RgnSpanState *cs = &gClipSpans[c];
+    short i, j, n, l, r, bl, br;
+
+    n = 0;
+    j = 0;
+    for (i = 0; i + 1 < na; i += 2) {
+        l = a[i];
+        r = a[i + 1];
+
+        /* Skip clip spans entirely left of this one */
+        while (j + 1 < cs->count && ClipEdge(cs->edges[j + 1], rc->dh) <= l)
+            j += 2;
+
+        /*
+         * Walk the clip spans overlapping [l,r). One that runs past r
+         * is left in place, since it may overlap the next span too.
+         */
+        for (; j + 1 < cs->count; j += 2) {
+            bl = ClipEdge(cs->edges[j], rc->dh);
+            br = ClipEdge(cs->edges[j + 1], rc->dh);
+            if (bl >= r)
+                break;
+            if (n + 2 > kMaxRgnEdges)
+                return -1;
+            if (rc->exclude) {
+                if (bl > l) {
+                    out[n++] = l;
+                    out[n++] = bl;
+                }
+                l = br;
+            } else {
+                out[n++] = bl > l ? bl : l;
+                out[n++] = br < r ? br : r;
+            }
+            if (br >= r)
+                break;
+        }
+
+        if (rc->exclude && l < r) {
+            if (n + 2 > kMaxRgnEdges)
+                return -1;
+            out[n++] = l;
+            out[n++] = r;
+        }
+    }
+    return n;
+}
+
+/*
+ * Clip one row's spans (n edges, copied from src) against every render
+ * clip. Returns a pointer to the result and its count in *n, or NULL
+ * if a clip region couldn't be decoded on this row.
+ */
+static const short *ClipRow(short y, const short *src, short *n)
+{
+    const short *cur = src;
+    short c, which = 0;
+
+    for (c = 0; c < gRenderClipCount; c++) {
+        if (!RgnSpansAdvance(&gClipSpans[c], gRenderClips[c].rgn,
+                             y - gRenderClips[c].dv))
+            return NULL;
+        *n = ClipSpanList(cur, *n, c, gRowSpans[which]);
+        if (*n < 0)
+            return NULL;
+        cur = gRowSpans[which];
+        which ^= 1;
+    }
+    return cur;
+}
+
+/* Per-pixel form of the clip test, for the PtInRgn fallback */
+static Boolean PtInClips(Point pt)
+{
+    Point local;
+    short c;
+    Boolean in;
+
+    for (c = 0; c < gRenderClipCount; c++) {
+        local.h = pt.h - gRenderClips[c].dh;
+        local.v = pt.v - gRenderClips[c].dv;
+        in = PtInRgn(local, gRenderClips[c].rgn);
+        if (in == gRenderClips[c].exclude)
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Pre-expanded pattern tile.
+ *
+ * The desktop PixPat almost never changes, so its tile is converted to
+ * 32bpp once into a system heap buffer and reused until anything it
+ * was built from changes: the PixPatHandle, the ctSeed of its color
+ * table, or for old-style patterns the colors they were drawn in.
+ *
+ * Each tile row is stored replicated side by side out to repWidth
+ * pixels (a whole number of tiles, at least kMinTileRun more than one
+ * tile), so a span fill only has to find its starting phase once and
+ * can then copy long straight runs without wrapping per pixel.
+ *
+ * With a backing store budget the rows are instead replicated across
+ * the widest 32bpp screen plus one tile. The pattern repeats every
+ * tile height, so those rows are a pre-rendered copy of the whole
+ * desktop: every span is then a single straight copy out of them. A
+ * literal screen-sized buffer would hold the same rows over and over
+ * (4MB at 1152x870) for no extra speed.
+ *
+ * A tile that comes out a single color is flagged solid and filled
+ * with plain longword stores, with no tile reads at all.
+ */
+#define kMinTileRun     64
+
+long gBackingBudget = 0;
+
+/* Everything a cached tile depends on */
+typedef struct {
+    PixPatHandle pp;        /* pattern the tile was expanded from */
+    short patType;
+    PixMapHandle patMap;    /* patType 1: its patMap and patData, so a */
+    Handle patData;         /* new pattern on a reused pp isn't missed */
+    UInt32 dataSum;         /* patType 1: TileDataSum of patData */
+    long ctSeed;            /* pmTable seed at expansion time, if any */
+    UInt32 fore;            /* patType 0 colors, patType 2 color */
+    UInt32 back;
+    UInt32 bits[2];         /* patType 0 pat1Data */
+    short width;
+    short height;
+    short repWidth;         /* replicated row width in pixels */
+} TileKey;
+
+typedef struct {
+    TileKey key;
+    short rowLongs;         /* row stride in pixels, repWidth rounded to 4 */
+    Boolean solid;          /* every pixel is color */
+    UInt32 color;
+    unsigned long serial;   /* bumped on every rebuild */
+    UInt32 *pixels;         /* height rows of rowLongs 32bpp pixels */
+    long allocSize;         /* bytes of arena block at pixels */
+} TileCache;
+
+static TileCache gTile;
+
+/* Port colors for old-style patterns, set by the caller */
+static UInt32 gPatFore = 0x00000000;
+static UInt32 gPatBack = 0x00FFFFFF;
+
+static UInt32 RGBToPixel32(const RGBColor *c)
+{
+    return ((UInt32)(c->red >> 8) << 16) |
+           ((UInt32)(c->green >> 8) << 8) |
+           (UInt32)(c->blue >> 8);
+}
+
+void SetPatternColors(const RGBColor *fore, const RGBColor *back)
+{
+    gPatFore = RGBToPixel32(fore);
+    gPatBack = RGBToPixel32(back);
+}
+
+static Boolean TileIsCurrent(const TileKey *k)
+{
+    return gTile.pixels &&
+           gTile.key.pp == k->pp && gTile.key.patType == k->patType &&
+           gTile.key.patMap == k->patMap && gTile.key.patData == k->patData &&
+           gTile.key.dataSum == k->dataSum && gTile.key.ctSeed == k->ctSeed &&
+           gTile.key.fore == k->fore && gTile.key.back == k->back &&
+           gTile.key.bits[0] == k->bits[0] && gTile.key.bits[1] == k->bits[1] &&
+           gTile.key.width == k->width && gTile.key.height == k->height &&
+           gTile.key.repWidth == k->repWidth;
+}
+
+/*
+ * Fingerprint of a tile's pixel data: up to kTileSumLongs longwords
+ * spread evenly over it, so the key check stays cheap for big tiles.
+ * Direct depths have no color table seed, so this (with the handles)
+ * is what tells a new pattern that landed on a disposed one's handle
+ * apart from it.
+ */
+#define kTileSumLongs   64
+
+static UInt32 TileDataSum(Ptr data, long size)
+{
+    const UInt32 *p = (const UInt32 *)data;
+    const unsigned char *b = (const unsigned char *)data;
+    long n = size >> 2, step, i;
+    UInt32 sum = (UInt32)size;
+
+    step = n > kTileSumLongs ? n / kTileSumLongs : 1;
+    for (i = 0; i < n; i += step)
+        sum = ((sum << 5) | (sum >> 27)) ^ p[i];
+
+    /* Rows of 1-bit tiles can leave a few bytes past the last long */
+    for (i = n << 2; i < size; i++)
+        sum = ((sum << 5) | (sum >> 27)) ^ b[i];
+    return sum;
+}
+
+/* Arena purge proc for the tile: it is expanded again when next used */
+static void PurgeTile(Ptr block)
+{
+    ArenaFree(block);
+    gTile.pixels = NULL;
+    gTile.allocSize = 0;
+    gTile.key.pp = NULL;
+}
+
+/*
+ * Make room in gTile for the tile described by k. The expander then
+ * writes the first width pixels of each row and FinishTile does the
+ * rest. A block of more than twice the size needed (a backing store
+ * strip given up, say) is traded for a smaller one.
+ */
+static Boolean AllocTile(const TileKey *k)
+{
+    long needed;
+
+    gTile.key.pp = NULL;
+    gTile.rowLongs = (k->repWidth + 3) & ~3;
+
+    /*
+     * Arena blocks are 16-byte aligned, and so is every row, so MOVE16
+     * can read straight from it
+     */
+    needed = (long)gTile.rowLongs * k->height * sizeof(UInt32);
+    if (needed > gTile.allocSize || needed < gTile.allocSize / 2) {
+        ArenaFree((Ptr)gTile.pixels);
+        gTile.pixels = (UInt32 *)ArenaAlloc(needed, PurgeTile);
+        gTile.allocSize = gTile.pixels ? needed : 0;
+        if (!gTile.pixels)
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Replicate each expanded row out to repWidth, note whether the tile
+ * is a single color, and record its key.
+ */
+static void FinishTile(const TileKey *k)
+{
+    UInt32 *row;
+    short tx, ty;
+    Boolean solid = true;
+    UInt32 color = gTile.pixels[0];
+
+    for (ty = 0; ty < k->height; ty++) {
+        row = gTile.pixels + (long)ty * gTile.rowLongs;
+        for (tx = 0; tx < k->width; tx++)
+            if (row[tx] != color)
+                solid = false;
+        for (tx = k->width; tx < k->repWidth; tx++)
+            row[tx] = row[tx - k->width];
+    }
+
+    gTile.solid = solid;
+    gTile.color = color;
+    gTile.key = *k;
+    gTile.serial++;
+}
+
+/*
+ * Expand a tile of any standard PixMap depth into gTile.pixels: 1, 2,
+ * 4 and 8 bits through the color table, 16 (5-5-5) and 32 bits
+ * directly. Each source pixel is converted once here, so the span
+ * fill never sees the original depth. Indexes past the end of the
+ * color table come out black. Handles must already be locked by the
+ * caller; ctab is only used for the indexed depths.
+ */
+static void ExpandPixels(Ptr patData, short tileRowBytes, short depth,
+                         CTabHandle ctab, short tileW, short tileH)
+{
+    short tx, ty, shift, index, ctSize;
+    unsigned char *src, mask;
+    unsigned short c16;
+    UInt32 *dst, r, g, b;
+
+    ctSize = ctab ? (**ctab).ctSize : -1;
+    mask = (unsigned char)((1 << (depth < 8 ? depth : 8)) - 1);
+
+    for (ty = 0; ty < tileH; ty++) {
+        src = (unsigned char *)patData + (long)ty * tileRowBytes;
+        dst = gTile.pixels + (long)ty * gTile.rowLongs;
+
+        switch (depth) {
+        case 32:
+            for (tx = 0; tx < tileW; tx++)
+                *dst++ = ((UInt32 *)src)[tx] & 0x00FFFFFF;
+            break;
+
+        case 16:
+            for (tx = 0; tx < tileW; tx++) {
+                c16 = ((unsigned short *)src)[tx];
+                r = (c16 >> 10) & 0x1F;
+                g = (c16 >> 5) & 0x1F;
+                b = c16 & 0x1F;
+                *dst++ = (((r << 3) | (r >> 2)) << 16) |
+                         (((g << 3) | (g >> 2)) << 8) |
+                         ((b << 3) | (b >> 2));
+            }
+            break;
+
+        default:
+            /* Indexed, most significant pixel first within each byte */
+            for (tx = 0; tx < tileW; tx++) {
+                shift = 8 - depth - (short)(((long)tx * depth) & 7);
+                index = (src[((long)tx * depth) >> 3] >> shift) & mask;
+                *dst++ = index <= ctSize ?
+                         RGBToPixel32(&(**ctab).ctTable[index].rgb) : 0;
+            }
+            break;
+        }
+    }
+}
+
+/*
+ * Replicated row width for a tile: the minimum run, or backing store
+ * rows if they fit the budget. Screen geometry feeds into this, so a
+ * screen change rebuilds the tile as well.
+ */
+static short MinRepWidth(short tileW)
+{
+    short repWidth = tileW;
+
+    while (repWidth < tileW + kMinTileRun)
+        repWidth += tileW;
+    return repWidth;
+}
+
+static short WantedRepWidth(short tileW, short tileH)
+{
+    short repWidth, backWidth, widest, w, i;
+
+    repWidth = MinRepWidth(tileW);
+    if (gBackingBudget <= 0)
+        return repWidth;
+
+    widest = 0;
+    for (i = 0; i < gScreenCount; i++) {
+        w = gScreens[i].bounds.right - gScreens[i].bounds.left;
+        if (IsRenderedDepth(gScreens[i].pixelSize) && w > widest)
+            widest = w;
+    }
+
+    /* Room for a full screen width starting at any phase */
+    backWidth = tileW * ((widest + 2 * tileW - 2) / tileW);
+    if (backWidth > repWidth &&
+        (long)((backWidth + 3) & ~3) * tileH * (long)sizeof(UInt32) <= gBackingBudget)
+        repWidth = backWidth;
+    return repWidth;
+}
+
+/*
+ * Allocate for k, falling back from backing store rows to the small
+ * ones if there isn't room for them.
+ */
+static Boolean AllocTileFor(TileKey *k)
+{
+    if (AllocTile(k))
+        return true;
+    if (k->repWidth == MinRepWidth(k->width))
+        return false;
+
+    /* No room for the backing store; drop it rather than retry */
+    gBackingBudget = 0;
+    k->repWidth = MinRepWidth(k->width);
+    return AllocTile(k);
+}
+
+/*
+ * patType 1: color pixel pattern, any standard depth.
+ */
+static Boolean PreparePixTile(PixPatHandle pp)
+{
+    PixMapHandle patMapH;
+    PixMapPtr patMap;
+    Handle patDataH;
+    CTabHandle ctab;
+    short tileRowBytes, tileDepth;
+    char patMapState, patDataState, ctabState;
+    TileKey k;
+
+    patMapH = (**pp).patMap;
+    patDataH = (**pp).patData;
+    if (!patMapH || !*patMapH || !patDataH || !*patDataH)
+        return false;
+
+    /*
+     * Nothing below moves memory until the rebuild, so the key can be
+     * read straight through the handles. A cache hit never locks.
+     */
+    patMap = *patMapH;
+
+    k.pp = pp;
+    k.patType = 1;
+    k.patMap = patMapH;
+    k.patData = patDataH;
+    k.fore = k.back = 0;
+    k.bits[0] = k.bits[1] = 0;
+    k.width = patMap->bounds.right - patMap->bounds.left;
+    k.height = patMap->bounds.bottom - patMap->bounds.top;
+    tileRowBytes = patMap->rowBytes & 0x3FFF;
+    tileDepth = patMap->pixelSize;
+
+    if (k.width <= 0 || k.height <= 0 ||
+        (tileDepth != 1 && tileDepth != 2 && tileDepth != 4 &&
+         tileDepth != 8 && tileDepth != 16 && tileDepth != 32))
+        return false;
+
+    /* Direct depths carry their colors in the pixels */
+    ctab = tileDepth <= 8 ? patMap->pmTable : NULL;
+    if (tileDepth <= 8 && (!ctab || !*ctab))
+        return false;
+
+    k.ctSeed = ctab ? (**ctab).ctSeed : 0;
+    k.dataSum = TileDataSum(*patDataH, (long)tileRowBytes * k.height);
+    k.repWidth = WantedRepWidth(k.width, k.height);
+    if (TileIsCurrent(&k))
+        return true;
+    if (!AllocTileFor(&k))
+        return false;
+
+    /* Rebuild: hold the pattern's handles still while expanding */
+    patMapState = HGetState((Handle)patMapH);
+    HLock((Handle)patMapH);
+    patDataState = HGetState(patDataH);
+    HLock(patDataH);
+    if (ctab) {
+        ctabState = HGetState((Handle)ctab);
+        HLock((Handle)ctab);
+    }
+
+    ExpandPixels(*patDataH, tileRowBytes, tileDepth, ctab,
+                 k.width, k.height);
+    FinishTile(&k);
+
+    /* Restore handle states */
+    if (ctab)
+        HSetState((Handle)ctab, ctabState);
+    HSetState((Handle)patMapH, patMapState);
+    HSetState(patDataH, patDataState);
+    return true;
+}
+
+/*
+ * patType 0: old-style 8x8 1-bit pattern, drawn in the port's
+ * foreground (set bits) and background colors as last passed to
+ * SetPatternColors.
+ */
+static Boolean PrepareOldTile(PixPatHandle pp)
+{
+    TileKey k;
+    short tx, ty;
+    UInt32 *dst;
+    unsigned char bits;
+
+    k.pp = pp;
+    k.patType = 0;
+    k.patMap = NULL;
+    k.patData = NULL;
+    k.dataSum = 0;
+    k.ctSeed = 0;
+    k.fore = gPatFore;
+    k.back = gPatBack;
+    BlockMoveData(&(**pp).pat1Data, k.bits, sizeof(k.bits));
+    k.width = 8;
+    k.height = 8;
+    k.repWidth = WantedRepWidth(8, 8);
+    if (TileIsCurrent(&k))
+        return true;
+    if (!AllocTileFor(&k))
+        return false;
+
+    for (ty = 0; ty < 8; ty++) {
+        bits = (**pp).pat1Data.pat[ty];
+        dst = gTile.pixels + (long)ty * gTile.rowLongs;
+        for (tx = 0; tx < 8; tx++)
+            *dst++ = (bits & (0x80 >> tx)) ? k.fore : k.back;
+    }
+    FinishTile(&k);
+    return true;
+}
+
+/*
+ * patType 2: RGB pattern made by MakeRGBPat. QuickDraw dithers it at
+ * lower depths, but at 32bpp the color is exact, so it is a solid
+ * fill. MakeRGBPat keeps the requested color in the last entry of the
+ * pattern's color table.
+ */
+static Boolean PrepareRGBTile(PixPatHandle pp)
+{
+    PixMapHandle patMapH;
+    CTabHandle ctab;
+    TileKey k;
+
+    patMapH = (**pp).patMap;
+    if (!patMapH || !*patMapH)
+        return false;
+    ctab = (**patMapH).pmTable;
+    if (!ctab || !*ctab || (**ctab).ctSize < 0)
+        return false;
+
+    k.pp = pp;
+    k.patType = 2;
+    k.patMap = NULL;
+    k.patData = NULL;
+    k.dataSum = 0;
+    k.ctSeed = (**ctab).ctSeed;
+    k.fore = RGBToPixel32(&(**ctab).ctTable[(**ctab).ctSize].rgb);
+    k.back = 0;
+    k.bits[0] = k.bits[1] = 0;
+    k.width = 1;
+    k.height = 1;
+    k.repWidth = MinRepWidth(1);
+    if (TileIsCurrent(&k))
+        return true;
+    if (!AllocTile(&k))
+        return false;
+
+    gTile.pixels[0] = k.fore;
+    FinishTile(&k);
+    return true;
+}
+
+/*
+ * 16bpp (Thousands) copy of the tile, for gRender16.
+ *
+ * Converted from the 32bpp tile to 5-5-5 whenever that is rebuilt, with
+ * the same replicated row layout, so 16bpp screens use the same span
+ * rasterizer and phase logic as 32bpp ones.
+ */
+typedef struct {
+    unsigned long serial;   /* gTile.serial it was converted from */
+    short rowShorts;        /* row stride in pixels, multiple of 8 */
+    UInt16 color;           /* gTile.color, if gTile.solid */
+    UInt16 *pixels;
+    long allocSize;
+} Tile16Cache;
+
+static Tile16Cache gTile16;
+
+static void PurgeTile16(Ptr block)
+{
+    ArenaFree(block);
+    gTile16.pixels = NULL;
+    gTile16.allocSize = 0;
+}
+
+static Boolean Ensure16Tile(void)
+{
+    long needed;
+    short tx, ty;
+    const UInt32 *src;
+    UInt32 c;
+    UInt16 *dst;
+
+    if (gTile16.pixels && gTile16.serial == gTile.serial) {
+        ArenaTouch((Ptr)gTile16.pixels);
+        return true;
+    }
+
+    gTile16.rowShorts = (gTile.key.repWidth + 7) & ~7;
+    needed = (long)gTile16.rowShorts * gTile.key.height * sizeof(UInt16);
+    if (needed > gTile16.allocSize || needed < gTile16.allocSize / 2) {
+        ArenaFree((Ptr)gTile16.pixels);
+        gTile16.pixels = (UInt16 *)ArenaAlloc(needed, PurgeTile16);
+        gTile16.allocSize = gTile16.pixels ? needed : 0;
+        if (!gTile16.pixels)
+            return false;
+    }
+
+    for (ty = 0; ty < gTile.key.height; ty++) {
+        src = gTile.pixels + (long)ty * gTile.rowLongs;
+        dst = gTile16.pixels + (long)ty * gTile16.rowShorts;
+        for (tx = 0; tx < gTile.key.repWidth; tx++) {
+            c = src[tx];
+            dst[tx] = (UInt16)(((c >> 9) & 0x7C00) | ((c >> 6) & 0x03E0) |
+                               ((c >> 3) & 0x001F));
+        }
+    }
+    gTile16.color = gTile16.pixels[0];
+    gTile16.serial = gTile.serial;
+    return true;
+}
+
+/*
+ * Make sure gTile holds the expanded tile for pp, rebuilding it if
+ * anything it depends on changed.
+ */
+static Boolean PrepareTile(PixPatHandle pp)
+{
+    Boolean ok = false;
+
+    if (!pp || !*pp)
+        return false;
+
+    switch ((**pp).patType) {
+    case 0:
+        ok = PrepareOldTile(pp);
+        break;
+    case 1:
+        ok = PreparePixTile(pp);
+        break;
+    case 2:
+        ok = PrepareRGBTile(pp);
+        break;
+    }
+
+    /* Keep the tile through this call, whatever else needs room */
+    if (ok)
+        ArenaTouch((Ptr)gTile.pixels);
+
+    /* 16bpp screens need their copy too, or QuickDraw gets the call */
+    if (ok && gRender16)
+        ok = Ensure16Tile();
+    return ok;
+}
+
+/*
+ * Longword copy blitters.
+ *
+ * A span is copied as runs of contiguous tile pixels, each handed to
+ * the screen's spanCopy, or gSpanCopy if it has none (and always for
+ * the staging buffer). The generic C copy is the default (and all the
+ * host bench gets); _start picks a 68k-specific one from
+ * gestaltProcessorType, or by timing them with kOptCalibrate.
+ */
+void SpanCopyC(UInt32 *dst, const UInt32 *src, long count)
+{
+    while (count-- > 0)
+        *dst++ = *src++;
+}
+
+SpanCopyProc gSpanCopy = SpanCopyC;
+
+#if defined(__m68k__)
+
+/*
+ * 68020/030: eight MOVE.L per DBRA iteration, then the leftovers.
+ */
+void SpanCopy020(UInt32 *dst, const UInt32 *src, long count)
+{
+    long n8 = count >> 3;
+
+    if (n8 > 0) {
+        n8--;
+        __asm__ volatile (
+            "1:\n\t"
+            "move.l (%0)+,(%1)+\n\t"
+            "move.l (%0)+,(%1)+\n\t"
+            "move.l (%0)+,(%1)+\n\t"
+            "move.l (%0)+,(%1)+\n\t"
+            "move.l (%0)+,(%1)+\n\t"
+            "move.l (%0)+,(%1)+\n\t"
+            "move.l (%0)+,(%1)+\n\t"
+            "move.l (%0)+,(%1)+\n\t"
+            "dbra %2,1b"
+            : "+a" (src), "+a" (dst), "+d" (n8)
+            :
+            : "memory");
+    }
+
+    count &= 7;
+    while (count-- > 0)
+        *dst++ = *src++;
+}
+
+/*
+ * 68040: MOVE16 bursts of one cache line (four longs) once dst is
+ * 16-byte aligned. Source and destination must then be aligned
+ * together, which holds whenever the tile is a multiple of four pixels
+ * wide on a framebuffer with 16-byte aligned rows; otherwise this is
+ * just the 020 copy.
+ *
+ * MOVE16 (a0)+,(a1)+ is emitted as raw opcode words so the INIT still
+ * assembles for a plain 68020 target.
+ */
+void SpanCopy040(UInt32 *dst, const UInt32 *src, long count)
+{
+    long n16;
+
+    if (count >= 8 && !(((unsigned long)src ^ (unsigned long)dst) & 15)) {
+        while (((unsigned long)dst & 15) && count > 0) {
+            *dst++ = *src++;
+            count--;
+        }
+
+        n16 = count >> 2;
+        count &= 3;
+        if (n16 > 0) {
+            register const UInt32 *s __asm__("a0") = src;
+            register UInt32 *d __asm__("a1") = dst;
+
+            n16--;
+            __asm__ volatile (
+                "1:\n\t"
+                ".word 0xF620,0x9000\n\t"     /* move16 (a0)+,(a1)+ */
+                "dbra %2,1b"
+                : "+a" (s), "+a" (d), "+d" (n16)
+                :
+                : "memory");
+            src = s;
+            dst = d;
+        }
+    }
+
+    SpanCopy020(dst, src, count);
+}
+
+#endif
+
+/*
+ * Scanline staging buffer for kBlitStaged screens, grown to the widest
+ * clipped span seen so far and 16-byte aligned like the tile.
+ */
+static UInt32 *gStage = NULL;
+static short gStageLongs = 0;
+
+static void PurgeStage(Ptr block)
+{
+    ArenaFree(block);
+    gStage = NULL;
+    gStageLongs = 0;
+}
+
+/*
+ * Staging buffer for spans up to width pixels wide on scr, or NULL to
+ * write directly - either because the screen wants direct writes or
+ * because the buffer couldn't be grown.
+ */
+static UInt32 *StageFor(const ScreenInfo *scr, short width)
+{
+    if (scr->blitMode != kBlitStaged)
+        return NULL;
+
+    if (width > gStageLongs) {
+        ArenaFree((Ptr)gStage);
+        gStage = (UInt32 *)ArenaAlloc((long)width * sizeof(UInt32), PurgeStage);
+        gStageLongs = gStage ? width : 0;
+    }
+    ArenaTouch((Ptr)gStage);
+    return gStage;
+}
+
+/*
+ * Fill pixels [left,right) of one framebuffer row from a replicated
+ * tile row, whose first pixel lands on x == phase (mod the tile
+ * width). The x phase is found once per span; after that the span is
+ * copied in runs of up to repWidth pixels, so any span no wider than
+ * kMinTileRun goes out as a single copy.
+ *
+ * With a staging buffer the runs are assembled there instead and the
+ * whole span goes to the framebuffer in one BlockMoveData.
+ */
+static void FillTileSpan(UInt32 *rowPtr, short left, short right,
+                         const UInt32 *tileRow, short phase,
+                         SpanCopyProc copy, UInt32 *stage)
+{
+    UInt32 *dst;
+    short tx, n, count;
+
+    count = right - left;
+    if (gTile.solid && !stage) {
+        /* One color: plain stores, nothing to read */
+        dst = rowPtr + left;
+        while (count-- > 0)
+            *dst++ = gTile.color;
+        gPixelsWritten += right - left;
+        return;
+    }
+
+    tx = (left - phase) % gTile.key.width;
+    if (tx < 0) tx += gTile.key.width;
+
+    if (stage && count <= gTile.key.repWidth - tx) {
+        /* Already contiguous in the tile row, no need to assemble it */
+        BlockMoveData(tileRow + tx, rowPtr + left, (long)count * sizeof(UInt32));
+        gPixelsWritten += count;
+        return;
+    }
+
+    dst = stage ? stage : rowPtr + left;
+    n = gTile.key.repWidth - tx;
+    while (count > 0) {
+        if (n > count)
+            n = count;
+        copy(dst, tileRow + tx, n);
+        dst += n;
+        count -= n;
+        tx = 0;
+        n = gTile.key.repWidth;
+    }
+
+    if (stage)
+        BlockMoveData(stage, rowPtr + left, (long)(right - left) * sizeof(UInt32));
+    gPixelsWritten += right - left;
+}
+
+/*
+ * 16bpp version of FillTileSpan. Runs where the screen and tile share
+ * longword alignment go through copy two pixels at a time; the
+ * rest are copied a pixel at a time. 16bpp screens always take direct
+ * writes.
+ */
+static void Copy16(UInt16 *dst, const UInt16 *src, short count,
+                   SpanCopyProc copy)
+{
+    if (count >= 4 && !(((unsigned long)dst ^ (unsigned long)src) & 2)) {
+        if ((unsigned long)dst & 2) {
+            *dst++ = *src++;
+            count--;
+        }
+        copy((UInt32 *)dst, (const UInt32 *)src, count >> 1);
+        dst += count & ~1;
+        src += count & ~1;
+        count &= 1;
+    }
+    while (count-- > 0)
+        *dst++ = *src++;
+}
+
+static void FillTileSpan16(UInt16 *rowPtr, short left, short right,
+                           const UInt16 *tileRow, short phase,
+                           SpanCopyProc copy)
+{
+    UInt16 *dst;
+    short tx, n, count;
+
+    count = right - left;
+    dst = rowPtr + left;
+    if (gTile.solid) {
+        while (count-- > 0)
+            *dst++ = gTile16.color;
+        gPixelsWritten += right - left;
+        return;
+    }
+
+    tx = (left - phase) % gTile.key.width;
+    if (tx < 0) tx += gTile.key.width;
+
+    n = gTile.key.repWidth - tx;
+    while (count > 0) {
+        if (n > count)
+            n = count;
+        Copy16(dst, tileRow + tx, n, copy);
+        dst += n;
+        count -= n;
+        tx = 0;
+        n = gTile.key.repWidth;
+    }
+    gPixelsWritten += right - left;
+}
+
+/*
+ * Tile row tracking for one screen, at that screen's depth. Begin
+ * works out the pattern's phase against gRenderOrigin and takes
+ * y % height once; Next steps a row per scanline.
+ */
+typedef struct {
+    const char *base;       /* tile row 0 */
+    long stride;            /* bytes per tile row */
+    const char *row;        /* tile row for the current scanline */
+    short ty;
+    short phase;            /* global x of a tile column 0 */
+    SpanCopyProc copy;      /* blitter for this screen */
+    Boolean depth16;
+} TileCursor;
+
+static void TileCursorBegin(TileCursor *c, const ScreenInfo *scr, short y)
+{
+    c->depth16 = scr->pixelSize == 16;
+    c->copy = scr->spanCopy ? scr->spanCopy : gSpanCopy;
+    if (c->depth16) {
+        c->base = (const char *)gTile16.pixels;
+        c->stride = (long)gTile16.rowShorts * sizeof(UInt16);
+    } else {
+        c->base = (const char *)gTile.pixels;
+        c->stride = (long)gTile.rowLongs * sizeof(UInt32);
+    }
+
+    c->phase = gRenderOrigin.h % gTile.key.width;
+    c->ty = ((long)y - gRenderOrigin.v) % gTile.key.height;
+    if (c->ty < 0) c->ty += gTile.key.height;
+    c->row = c->base + c->ty * c->stride;
+}
+
+static void TileCursorNext(TileCursor *c)
+{
+    if (++c->ty == gTile.key.height) {
+        c->ty = 0;
+        c->row = c->base;
+    } else {
+        c->row += c->stride;
+    }
+}
+
+static void FillSpan(const TileCursor *c, Ptr rowPtr, short left, short right,
+                     UInt32 *stage)
+{
+    if (c->depth16)
+        FillTileSpan16((UInt16 *)rowPtr, left, right, (const UInt16 *)c->row,
+                       c->phase, c->copy);
+    else
+        FillTileSpan((UInt32 *)rowPtr, left, right, (const UInt32 *)c->row,
+                     c->phase, stage ? gSpanCopy : c->copy, stage);
+}
+
+/*
+ * Fill the part of a region that falls inside clip (already clipped to
+ * the screen) on one 32bpp or 16bpp screen. rgn may be NULL when bands
+ * are given and no render clips are set.
+ *
+ * Walks the region's inversion points once per scanline and fills
+ * whole spans, so cost scales with region complexity rather than bbox
+ * area. Regions too complex for the span decoder fall back to PtInRgn.
+ */
+static void RenderRgnOnScreen(const ScreenInfo *scr, RgnHandle rgn,
+                              const short *bands, const Rect *clip)
+{
+    short x, y, ly, i, n;
+    short spanL, spanR;
+    const short *spans;
+    const short *band = bands;
+    const short *rowEdges = NULL;
+    short rowCount = 0;
+    Ptr rowPtr;
+    UInt32 *stage;
+    TileCursor tc;
+    Point pt, local;
+
+    /*
+     * Nothing below moves memory, so the region handle stays put while
+     * the decoder reads it.
+     */
+    stage = scr->pixelSize == 32 ? StageFor(scr, clip->right - clip->left) : NULL;
+    if (!bands)
+        RgnSpansBegin(rgn, &gRgnSpans);
+    ClipSpansBegin();
+    TileCursorBegin(&tc, scr, clip->top);
+
+    for (y = clip->top; y < clip->bottom; y++, TileCursorNext(&tc)) {
+        ly = y - gRenderOrigin.v;
+        if (bands) {
+            while (*band <= ly) {
+                rowCount = band[1];
+                rowEdges = band + 2;
+                band = rowEdges + rowCount;
+            }
+            spans = rowEdges;
+            n = rowCount;
+        } else {
+            if (!RgnSpansAdvance(&gRgnSpans, rgn, ly))
+                break;
+            spans = gRgnSpans.edges;
+            n = gRgnSpans.count;
+        }
+        if (gRenderOrigin.h)
+            spans = OriginRow(spans, n);
+        if (gRenderClipCount > 0 && !(spans = ClipRow(y, spans, &n)))
+            break;
+
+        rowPtr = ScreenRow(scr, y);
+
+        for (i = 0; i + 1 < n; i += 2) {
+            spanL = spans[i];
+            spanR = spans[i + 1];
+            if (spanL < clip->left) spanL = clip->left;
+            if (spanR > clip->right) spanR = clip->right;
+            if (spanL < spanR)
+                FillSpan(&tc, rowPtr, spanL, spanR, stage);
+        }
+    }
+
+    /* Decoder gave up partway: finish the remaining rows per pixel */
+    for (; rgn && y < clip->bottom; y++, TileCursorNext(&tc)) {
+        rowPtr = ScreenRow(scr, y);
+        pt.v = y;
+        local.v = y - gRenderOrigin.v;
+
+        for (x = clip->left; x < clip->right; x++) {
+            pt.h = x;
+            local.h = x - gRenderOrigin.h;
+            if (PtInRgn(local, rgn) && PtInClips(pt))
+                FillSpan(&tc, rowPtr, x, x + 1, NULL);
+        }
+    }
+}
+
+/*
+ * Fill a rect (already clipped to the screen) on one screen: one span
+ * per row, cut down by the render clips if there are any.
+ */
+static void RenderRectOnScreen(const ScreenInfo *scr, const Rect *clip)
+{
+    short x, y, i, n;
+    short row[2];
+    const short *spans;
+    Ptr rowPtr;
+    UInt32 *stage;
+    TileCursor tc;
+    Point pt;
+
+    stage = scr->pixelSize == 32 ? StageFor(scr, clip->right - clip->left) : NULL;
+    ClipSpansBegin();
+    TileCursorBegin(&tc, scr, clip->top);
+
+    row[0] = clip->left;
+    row[1] = clip->right;
+    for (y = clip->top; y < clip->bottom; y++, TileCursorNext(&tc)) {
+        rowPtr = ScreenRow(scr, y);
+        spans = row;
+        n = 2;
+        if (gRenderClipCount > 0 && !(spans = ClipRow(y, spans, &n)))
+            break;
+
+        for (i = 0; i + 1 < n; i += 2) {
+            if (spans[i] < spans[i + 1])
+                FillSpan(&tc, rowPtr, spans[i], spans[i + 1], stage);
+        }
+    }
+
+    /* A clip region was too complex to decode: test pixels directly */
+    for (; y < clip->bottom; y++, TileCursorNext(&tc)) {
+        rowPtr = ScreenRow(scr, y);
+        pt.v = y;
+
+        for (x = clip->left; x < clip->right; x++) {
+            pt.h = x;
+            if (PtInClips(pt))
+                FillSpan(&tc, rowPtr, x, x + 1, NULL);
+        }
+    }
+}
+
+/* Move a rect in the fill's coordinates to global, clamped like ClipEdge */
+static void OffsetToGlobal(Rect *r)
+{
+    r->left = ClipEdge(r->left, gRenderOrigin.h);
+    r->right = ClipEdge(r->right, gRenderOrigin.h);
+    r->top = ClipEdge(r->top, gRenderOrigin.v);
+    r->bottom = ClipEdge(r->bottom, gRenderOrigin.v);
+}
+
+/*
+ * Fill rgn from the cached tile on every screen it touches. The tile
+ * must be prepared and touched for the current call.
+ */
+static void RenderCachedTileInRgn(RgnHandle rgn)
+{
+    Rect bbox, clip;
+    const short *bands;
+    short i;
+
+    bands = LookupRgnBands(rgn);
+    bbox = (**rgn).rgnBBox;
+    OffsetToGlobal(&bbox);
+    for (i = 0; i < gScreenCount; i++) {
+        if (IsRenderedDepth(gScreens[i].pixelSize) &&
+            ClipToScreen(&bbox, &gScreens[i], &clip))
+            RenderRgnOnScreen(&gScreens[i], rgn, bands, &clip);
+    }
+}
+
+/*
+ * Render a PixPat pattern tile directly to the framebuffer inside a region.
+ * Copies pixels from the cached 32bpp tile, bypassing QuickDraw entirely.
+ * The region is split across every 32bpp screen it touches (and 16bpp
+ * ones with gRender16); parts on other screens are left alone.
+ *
+ * Returns false without touching the screen if the pattern can't be
+ * rendered, so a head patch knows to call the original trap instead.
+ */
+Boolean RenderPatternInRgn(RgnHandle rgn, PixPatHandle pp)
+{
+    ArenaNewEpoch();
+    if (!PrepareTile(pp))
+        return false;
+
+    RenderCachedTileInRgn(rgn);
+    return true;
+}
+
+/*
+ * Expand pp into the tile cache ahead of time. Returns false if the
+ * pattern is one the renderers can't draw.
+ */
+Boolean PreparePattern(PixPatHandle pp)
+{
+    ArenaNewEpoch();
+    return PrepareTile(pp);
+}
+
+/*
+ * Render whatever tile is currently cached inside rgn, without looking
+ * at the PixPat again. Used to flush deferred fills, by which time the
+ * pattern handle may no longer be safe to touch. Does nothing if no
+ * tile has been prepared, or it has been purged since.
+ */
+void RenderTileInRgn(RgnHandle rgn)
+{
+    ArenaNewEpoch();
+    if (!gTile.key.pp)
+        return;
+
+    ArenaTouch((Ptr)gTile.pixels);
+    if (gRender16 && !Ensure16Tile())
+        return;
+    RenderCachedTileInRgn(rgn);
+}
+
+/*
+ * Render a PixPat pattern tile directly to the framebuffer inside a rect.
+ * Same as RenderPatternInRgn but for rectangles (one span per row).
+ */
+Boolean RenderPatternInRect(const Rect *r, PixPatHandle pp)
+{
+    Rect global, clip;
+    short i;
+
+    ArenaNewEpoch();
+    if (!PrepareTile(pp))
+        return false;
+
+    global = *r;
+    OffsetToGlobal(&global);
+    for (i = 0; i < gScreenCount; i++) {
+        if (IsRenderedDepth(gScreens[i].pixelSize) &&
+            ClipToScreen(&global, &gScreens[i], &clip))
+            RenderRectOnScreen(&gScreens[i], &clip);
+    }
+    return true;
+}
+
+/*
+ * Deferred fill, for painting from interrupt time.
+ *
+ * A VBL task can't touch a handle, since the Memory Manager may be
+ * moving it when the interrupt hits. DeferTileInRgn decodes the region
+ * into bands in the cache arena at task level; RenderDeferredTile then
+ * needs nothing but the arena and the screen table. The bands are
+ * dropped like any other cache under memory pressure, in which case
+ * there is simply nothing deferred.
+ */
+#define kDeferShorts        4096
+
+static short *gDeferBands = NULL;
+static Rect gDeferBBox;
+static Boolean gDeferValid = false;
+
+static void PurgeDeferBands(Ptr block)
+{
+    ArenaFree(block);
+    gDeferBands = NULL;
+    gDeferValid = false;
+}
+
+Boolean DeferTileInRgn(RgnHandle rgn)
+{
+    gDeferValid = false;
+    if (!gTile.key.pp || !rgn || !*rgn)
+        return false;
+
+    if (!gDeferBands)
+        gDeferBands = (short *)ArenaAlloc(kDeferShorts * sizeof(short),
+                                          PurgeDeferBands);
+    if (!gDeferBands)
+        return false;
+
+    gDeferValid = DecodeRgnBands(rgn, gDeferBands, kDeferShorts);
+    gDeferBBox = (**rgn).rgnBBox;
+    return gDeferValid;
+}
+
+void CancelDeferredTile(void)
+{
+    gDeferValid = false;
+}
+
+Boolean RenderDeferredTile(void)
+{
+    Rect bbox, clip;
+    short i;
+
+    ArenaNewEpoch();
+    if (!gDeferValid || !gTile.key.pp)
+        return false;
+
+    ArenaTouch((Ptr)gDeferBands);
+    ArenaTouch((Ptr)gTile.pixels);
+    if (gRender16 && !Ensure16Tile())
+        return false;
+
+    bbox = gDeferBBox;
+    OffsetToGlobal(&bbox);
+    for (i = 0; i < gScreenCount; i++) {
+        if (IsRenderedDepth(gScreens[i].pixelSize) &&
+            ClipToScreen(&bbox, &gScreens[i], &clip))
+            RenderRgnOnScreen(&gScreens[i], NULL, gDeferBands, &clip);
+    }
+    gDeferValid = false;
+    return true;
+}
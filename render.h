@@ -0,0 +1,148 @@
+/*
+ * DesktopFix pattern rendering core
+ *
+ * Everything that turns a PixPat plus a region or rect into 32bpp
+ * framebuffer writes: the region span decoder, the expanded tile
+ * cache and the span fill. It touches no traps beyond the Memory
+ * Manager and PtInRgn, so the host benchmark in bench/ compiles it
+ * unchanged against mock Toolbox structs.
+ */
+
+#ifndef __render__
+#define __render__
+
+#include <Quickdraw.h>
+
+/* Longword copy used for span runs, see gSpanCopy */
+typedef void (*SpanCopyProc)(UInt32 *dst, const UInt32 *src, long count);
+
+/*
+ * Cached framebuffer info for one screen GDevice. Every active screen
+ * is recorded, whatever its depth; only the 32bpp ones (and 16bpp ones
+ * with gRender16) are rendered directly, the rest tell the head patch
+ * to leave that area to QuickDraw.
+ *
+ * blitMode picks how spans reach the framebuffer. kBlitDirect copies
+ * straight from the tile cache into VRAM, which suits onboard video.
+ * kBlitStaged assembles each span in a system heap scanline buffer
+ * first and writes it with one BlockMoveData, so a NuBus card sees a
+ * single long burst per span instead of short runs. spanCopy, if set,
+ * replaces gSpanCopy for writes into this framebuffer; kOptCalibrate
+ * picks both per screen by timing them.
+ */
+#define kMaxScreens     8
+
+enum {
+    kBlitDirect = 0,
+    kBlitStaged
+};
+
+typedef struct {
+    GDHandle device;
+    Ptr baseAddr;
+    long rowBytes;
+    Rect bounds;            /* global coordinates of the framebuffer */
+    short pixelSize;
+    short blitMode;         /* kBlitDirect or kBlitStaged */
+    SpanCopyProc spanCopy;  /* blitter into this framebuffer, NULL for gSpanCopy */
+} ScreenInfo;
+
+/* Screen table, filled by EnsureScreenInfo (or the bench) */
+extern ScreenInfo gScreens[kMaxScreens];
+extern short gScreenCount;
+
+/* Pixels written by the span fill, for the stats counters */
+extern unsigned long gPixelsWritten;
+
+/*
+ * Bytes the tile cache may use to hold a screen-wide pre-rendered
+ * strip of the desktop (backing store mode). 0 keeps the small
+ * replicated rows. Cleared if the allocation ever fails.
+ */
+extern long gBackingBudget;
+
+/*
+ * How many decoded regions the span cache keeps, up to
+ * kSpanCacheEntries. 0 decodes every region afresh.
+ */
+#define kSpanCacheEntries   4
+
+extern short gSpanCacheSize;
+
+/*
+ * Also render to 16bpp (Thousands) screens, from a 5-5-5 copy of the
+ * tile. QuickDraw is correct there, just slower; this is purely a
+ * speed option.
+ */
+extern Boolean gRender16;
+
+Boolean IsRenderedDepth(short pixelSize);
+
+/*
+ * Longword copy used for every span run, unless a screen has its own.
+ * Defaults to plain C; the INIT points it at a CPU-specific blitter at
+ * startup.
+ */
+extern SpanCopyProc gSpanCopy;
+
+void SpanCopyC(UInt32 *dst, const UInt32 *src, long count);
+
+#if defined(__m68k__)
+void SpanCopy020(UInt32 *dst, const UInt32 *src, long count);
+void SpanCopy040(UInt32 *dst, const UInt32 *src, long count);
+#endif
+
+/*
+ * Regions every fill is clipped to, on top of the screen bounds. Each
+ * is in its own coordinates, offset by (dh, dv) to global, so a port's
+ * visRgn and clipRgn can be used as they are. An exclude clip removes
+ * its area instead (the window union). Set by the caller around a
+ * render call and cleared afterwards; the regions must not move while
+ * they are in use.
+ */
+#define kMaxRenderClips 3
+
+typedef struct {
+    RgnHandle rgn;
+    short dh;
+    short dv;
+    Boolean exclude;
+} RenderClip;
+
+extern RenderClip gRenderClips[kMaxRenderClips];
+extern short gRenderClipCount;
+
+/*
+ * Where the fill's own coordinates (the port's local ones) put their
+ * origin on the screen: the region or rect is offset by it to global,
+ * and the pattern is aligned to it, so tile pixel (0,0) falls on local
+ * (0,0) as it does when QuickDraw draws. (0,0) for WMgrCPort. Set by
+ * the caller around a render call, like the clips.
+ */
+extern Point gRenderOrigin;
+
+Boolean ClipToScreen(const Rect *r, const ScreenInfo *scr, Rect *out);
+Boolean RenderPatternInRgn(RgnHandle rgn, PixPatHandle pp);
+Boolean RenderPatternInRect(const Rect *r, PixPatHandle pp);
+
+/*
+ * Colors old-style (patType 0) patterns are drawn in: the current
+ * port's foreground and background. Set before rendering one.
+ */
+void SetPatternColors(const RGBColor *fore, const RGBColor *back);
+
+/* Split form of RenderPatternInRgn, for fills that are deferred */
+Boolean PreparePattern(PixPatHandle pp);
+void RenderTileInRgn(RgnHandle rgn);
+
+/*
+ * Interrupt-time form of RenderTileInRgn. DeferTileInRgn snapshots a
+ * region's spans against the current tile (task level, may allocate);
+ * RenderDeferredTile paints the snapshot once, touching no handles, or
+ * returns false if there is none (canceled, failed or purged).
+ */
+Boolean DeferTileInRgn(RgnHandle rgn);
+Boolean RenderDeferredTile(void);
+void CancelDeferredTile(void);
+
+#endif /* __render__ */
@@ -0,0 +1,69 @@
+/*
+ * DumpTrace - save the DesktopFix call trace to a file
+ *
+ * Takes a snapshot of the live trace ring published through
+ * Gestalt(kDesktopFixTraceGestalt) and writes it, as it is in memory,
+ * to "DesktopFix Trace" in the application's folder. Copy that file to
+ * a host and run DesktopFixBench -r on it to replay the calls.
+ *
+ * The INIT only keeps a trace with kOptTrace: option bit $40 in its
+ * 'DsFx' 128 resource, read at startup.
+ */
+
+#include <stdio.h>
+#include <Memory.h>
+#include <Files.h>
+#include <Gestalt.h>
+#include "DesktopFixTrace.h"
+
+int main(void)
+{
+    DesktopFixTrace *trace;
+    Ptr snap;
+    long response, count;
+    unsigned long calls;
+    short refNum;
+    OSErr err;
+
+    if (Gestalt(kDesktopFixTraceGestalt, &response) != noErr || !response) {
+        printf("DesktopFix isn't tracing. Set option bit $40 (kOptTrace) "
+               "in its 'DsFx' resource and restart.\n");
+        return 1;
+    }
+
+    trace = (DesktopFixTrace *)response;
+    if (trace->version != kDesktopFixTraceVersion) {
+        printf("Unknown trace version %d.\n", trace->version);
+        return 1;
+    }
+
+    /* Copy first, so the patches can't change it halfway through the write */
+    count = trace->structSize;
+    snap = NewPtr(count);
+    if (!snap) {
+        printf("Not enough memory for a %ld byte snapshot.\n", count);
+        return 1;
+    }
+    BlockMoveData(trace, snap, count);
+    calls = ((DesktopFixTrace *)snap)->next;
+
+    HDelete(0, 0, "\pDesktopFix Trace");
+    err = HCreate(0, 0, "\pDesktopFix Trace", 'DsFx', 'DsFt');
+    if (err == noErr)
+        err = HOpenDF(0, 0, "\pDesktopFix Trace", fsWrPerm, &refNum);
+    if (err == noErr) {
+        err = FSWrite(refNum, &count, snap);
+        FSClose(refNum);
+    }
+    DisposePtr(snap);
+
+    if (err != noErr) {
+        printf("Couldn't write \"DesktopFix Trace\" (error %d).\n", err);
+        return 1;
+    }
+
+    printf("Saved the last %lu of %lu calls to \"DesktopFix Trace\".\n",
+           calls < kDFTraceEntries ? calls : (unsigned long)kDFTraceEntries,
+           calls);
+    return 0;
+}